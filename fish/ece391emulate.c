@@ -225,3 +225,12 @@ ece391_close (int32_t fd)
     return 0;
 }
 
+int32_t 
+ece391_brk (uint32_t addr)
+{
+    if (0 == addr)
+        return (int32_t)sbrk (0);
+    if (-1 == brk ((void*)addr))
+        return -1;
+    return addr;
+}
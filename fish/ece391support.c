@@ -51,3 +51,111 @@ ece391_strncmp (const uint8_t* s1, const uint8_t* s2, uint32_t n)
     return ((int32_t)*s1) - ((int32_t)*s2);
 }
 
+
+/*
+ * Heap allocator. Small blocks come in power of two size classes (header
+ * included), each with its own free list, so malloc and free are a pop or
+ * push on it. A class that runs dry takes a chunk from the heap and splits
+ * it up. Larger blocks are carved from the heap as they are and reused
+ * first fit; one freed at the top of the heap is given back instead.
+ */
+#define NULL            0
+#define MALLOC_CLASSES  8       /* 16 to 2048 byte blocks */
+#define MALLOC_MIN      16
+#define MALLOC_CHUNK    4096    /* heap taken at a time to refill a class */
+#define MALLOC_LARGE    MALLOC_CLASSES
+#define MALLOC_ALIGN    8
+
+typedef struct malloc_hdr {
+    uint32_t cls;               /* size class, MALLOC_LARGE for big blocks */
+    uint32_t size;              /* whole block, header included */
+} malloc_hdr_t;
+
+/* A free block keeps its list link where the caller's data went */
+typedef struct malloc_free {
+    malloc_hdr_t hdr;
+    struct malloc_free* next;
+} malloc_free_t;
+
+static uint32_t heap_end;
+static malloc_free_t* free_lists[MALLOC_CLASSES + 1];
+
+/* Move the end of the heap by incr bytes, returns its old end or -1 */
+void*
+ece391_sbrk (int32_t incr)
+{
+    uint32_t old;
+
+    /* Blocks start aligned, whatever the image left the break at */
+    if (0 == heap_end)
+        heap_end = (ece391_brk (0) + MALLOC_ALIGN - 1) & ~(MALLOC_ALIGN - 1);
+
+    old = heap_end;
+    if (-1 == ece391_brk (old + incr))
+        return (void*)-1;
+    heap_end = old + incr;
+    return (void*)old;
+}
+
+void*
+ece391_malloc (uint32_t size)
+{
+    malloc_free_t* blk;
+    malloc_free_t** link;
+    uint8_t* chunk;
+    uint32_t need = size + sizeof (malloc_hdr_t);
+    uint32_t cls, bsize, i;
+
+    if (0 == size || need < size)
+        return NULL;
+    for (cls = 0, bsize = MALLOC_MIN; cls < MALLOC_CLASSES && bsize < need; cls++, bsize <<= 1);
+
+    if (cls < MALLOC_CLASSES) {
+        if (NULL == free_lists[cls]) {
+            if ((void*)-1 == (chunk = ece391_sbrk (MALLOC_CHUNK)))
+                return NULL;
+            for (i = 0; i < MALLOC_CHUNK; i += bsize) {
+                blk = (malloc_free_t*)(chunk + i);
+                blk->hdr.cls = cls;
+                blk->hdr.size = bsize;
+                blk->next = free_lists[cls];
+                free_lists[cls] = blk;
+            }
+        }
+        blk = free_lists[cls];
+        free_lists[cls] = blk->next;
+        return &blk->next;
+    }
+
+    need = (need + MALLOC_MIN - 1) & ~(MALLOC_MIN - 1);
+    for (link = &free_lists[MALLOC_LARGE]; NULL != *link; link = &(*link)->next) {
+        if ((*link)->hdr.size >= need) {
+            blk = *link;
+            *link = blk->next;
+            return &blk->next;
+        }
+    }
+
+    if ((void*)-1 == (blk = ece391_sbrk (need)))
+        return NULL;
+    blk->hdr.cls = MALLOC_LARGE;
+    blk->hdr.size = need;
+    return &blk->next;
+}
+
+void
+ece391_free (void* ptr)
+{
+    malloc_free_t* blk;
+
+    if (NULL == ptr)
+        return;
+    blk = (malloc_free_t*)((malloc_hdr_t*)ptr - 1);
+
+    if (MALLOC_LARGE == blk->hdr.cls && (uint32_t)blk + blk->hdr.size == heap_end) {
+        (void)ece391_sbrk (-(int32_t)blk->hdr.size);
+        return;
+    }
+    blk->next = free_lists[blk->hdr.cls];
+    free_lists[blk->hdr.cls] = blk;
+}
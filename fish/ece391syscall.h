@@ -19,6 +19,22 @@ extern int32_t ece391_open (const uint8_t* filename);
 extern int32_t ece391_close (int32_t fd);
 extern int32_t ece391_getargs (uint8_t* buf, int32_t nbytes);
 extern int32_t ece391_vidmap (uint8_t** screen_start);
+extern int32_t ece391_set_tick (uint32_t hz);
+extern int32_t ece391_set_quantum (uint32_t ms);
+
+/* Time since boot and CPU time of the caller, in TSC cycles */
+struct ece391_clock {
+	uint64_t now;
+	uint64_t user;
+	uint64_t kernel;
+	uint32_t cycles_per_ms;
+};
+extern int32_t ece391_getclock (struct ece391_clock* buf);
+extern int32_t ece391_sleep (uint32_t ms);
+extern int32_t ece391_fork (void);
+/* Sets *len to the bytes mapped, returns NULL on failure */
+extern void* ece391_mmap (int32_t fd, uint32_t* len);
+extern int32_t ece391_brk (uint32_t addr);
 
 #endif /* ECE391SYSCALL_H */
 
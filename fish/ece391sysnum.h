@@ -11,5 +11,12 @@
 #define SYS_VIDMAP  8
 #define SYS_SET_HANDLER  9
 #define SYS_SIGRETURN  10
+#define SYS_SET_TICK    11
+#define SYS_SET_QUANTUM 12
+#define SYS_GETCLOCK    13
+#define SYS_SLEEP       14
+#define SYS_FORK        15
+#define SYS_MMAP        16
+#define SYS_BRK         17
 
 #endif /* ECE391SYSNUM_H */
@@ -1,8 +1,10 @@
 #include "PCB.h"
 #include "scheduler.h"
+#include "slab.h"
 
-// Extern declaration of process control block
-extern pb_t pcb[PCB_SIZE];
+// Process control block, num_pids entries sized from RAM at boot
+pb_t* pcb;
+int32_t num_pids;
 
 // File operations tables
 // Link to Linux source code: https://elixir.bootlin.com/linux/v3.16.45/source/include/linux/fs.h#L1467
@@ -18,25 +20,22 @@ file_op_t* fileops_table[3] = {&rtc_fileops, &dir_fileops, &file_fileops};
 /* void init_pcb(void);
  * Inputs: void
  * Return Value: none
- * Function: Initializes the PCB table */
+ * Function: Initializes the PCB table, with room for as many processes as
+ * the free frames can hold. Call after init_frames */
 void init_pcb(){
-    int i, j;
-    // Initialize the stdin and stdout fd
-    fd_t stdin_fd = {&stdin_fileops, 0, 0, FD_EXISTS};
-    fd_t stdout_fd = {&stdout_fileops, 0, 0, FD_EXISTS};
+    int i;
 
-    for(i=0; i < PCB_SIZE; i++){
-        // Stdin and Stdout are fixed to 0 and 1 
-        pcb[i].fd_table[0] = stdin_fd;
-        pcb[i].fd_table[1] = stdout_fd;
+    // Pids index the table, so it is one allocation. Descriptor tables
+    // come with each process
+    num_pids = frames_free() / PROC_FRAMES;
+    if(num_pids > KSTACK_MAX_SLOTS) num_pids = KSTACK_MAX_SLOTS;
+    pcb = kmalloc(num_pids * sizeof(pb_t));
+    if(pcb == NULL) num_pids = 0;
 
+    for(i=0; i < num_pids; i++){
         // Initialize process to absent
         pcb[i].flags = PCB_ABSENT;
-
-        // Initialize table entries to invalid
-        for(j=2; j < FDT_SIZE; j++){
-            pcb[i].fd_table[j].flags = FD_ABSENT;
-        }
+        pcb[i].fd_table = NULL;
     }
 }
 
@@ -52,28 +51,58 @@ int32_t create_process(int parent){
     new_process.parent = parent;
     new_process.stack_ptr = 0;
     new_process.base_ptr = 0;
+    new_process.forked = 0;
     new_process.flags = PCB_EXISTS;
+    new_process.state = PROC_READY;
+    new_process.level = 0;
+    new_process.ticks_used = 0;
+    new_process.quantum_ms = (parent == -1) ? QUANTUM_MS : pcb[parent].quantum_ms;
+    new_process.terminal = exec_terminal;
+    new_process.cpu = this_cpu()->id;
+    new_process.in_kernel = 1;
+    new_process.user_cycles = 0;
+    new_process.kernel_cycles = 0;
+    timer_init(&new_process.sleep_timer, NULL, -1);
+    new_process.q_next = -1;
+    new_process.q_prev = -1;
 
-    // Initialize file descriptor table
-    fd_t stdin_fd = {&stdin_fileops, 0, 0, FD_EXISTS};
-    fd_t stdout_fd = {&stdout_fileops, 0, 0, FD_EXISTS};
-    new_process.fd_table[0] = stdin_fd; 
-    new_process.fd_table[1] = stdout_fd;
-
-    int i;
-    for(i=2; i < FDT_SIZE; i++) {
-        new_process.fd_table[i].flags = FD_ABSENT;
-    }
+    int i, j;
 
     // Insert process in PCB, i refers to pid
-    for(i=0; i < PCB_SIZE; i++){
-        if(pcb[i].flags == PCB_ABSENT){ 
-            pcb[i] = new_process;
-            return i;
-        }
-    }  
+    for(i=0; i < num_pids; i++){
+        if(pcb[i].flags == PCB_ABSENT) break;
+    }
     // Process creation failed, PCB is full
-    return -1; 
+    if(i == num_pids) return -1;
+
+    // Kernel stack, page table and directory come from the frame
+    // allocator, the program's pages are added as it is loaded
+    new_process.kstack = map_kstack(i);
+    new_process.page_table = (uint32_t)kalloc_frames(FRAME_SIZE);
+    new_process.page_dir = 0;
+    if(new_process.page_table != 0) new_process.page_dir = create_page_dir(new_process.page_table);
+    new_process.user_pages = 0;
+    new_process.fd_table = kmalloc(FDT_SIZE * sizeof(fd_t));
+    if(new_process.kstack == 0 || new_process.page_table == 0 || new_process.page_dir == 0 || new_process.fd_table == NULL){
+        if(new_process.kstack != 0) unmap_kstack(i);
+        free_frames(new_process.page_table, 1);
+        free_frames(new_process.page_dir, 1);
+        kfree(new_process.fd_table);
+        return -1;
+    }
+
+    // Initialize file descriptor table, stdin and stdout are fixed to 0 and 1
+    fd_t stdin_fd = {&stdin_fileops, 0, 0, FD_EXISTS, NULL};
+    fd_t stdout_fd = {&stdout_fileops, 0, 0, FD_EXISTS, NULL};
+    new_process.fd_table[0] = stdin_fd;
+    new_process.fd_table[1] = stdout_fd;
+    for(j=2; j < FDT_SIZE; j++){
+        new_process.fd_table[j].flags = FD_ABSENT;
+        new_process.fd_table[j].data = NULL;
+    }
+
+    pcb[i] = new_process;
+    return i;
 }
 
 
@@ -108,28 +137,66 @@ void print_process_data(uint32_t idx)
 */
 int32_t end_process(int32_t pid){
     if(pid == -1) return -1;
-    if(pcb[pid].flags == PCB_ABSENT) return -1;
+    if(pcb[pid].flags != PCB_EXISTS) return -1;
 
-    pcb[pid].flags = PCB_ABSENT;
     pcb[pid].argument[0] = '\0';
 
-    // Clear file descriptor table
+    // Give the memory back. A process ending itself is still on its kernel
+    // stack, so that and its pid wait for the CPU to switch away. Until
+    // then it must keep interrupts off
+    uint32_t esp;
+    asm volatile("movl %%esp, %0" : "=r"(esp));
+    free_user_pages(pid);
+    if(esp - pcb[pid].kstack < KSTACK_SIZE){
+        pcb[pid].flags = PCB_DEAD;
+        this_cpu()->reap = pid;
+    }
+    else{
+        unmap_kstack(pid);
+        pcb[pid].flags = PCB_ABSENT;
+    }
+
+    // Free the file descriptor table (pid need not be the running
+    // process). Only RTC descriptors hold state, drop their clients first
     int i;
     for(i=2; i < FDT_SIZE; i++){
-        rem_fd(i);
+        fd_t* file = &pcb[pid].fd_table[i];
+        if(file->flags == FD_EXISTS && file->file_operations_table == &rtc_fileops && file->data != NULL){
+            rtc_release(file->data);
+        }
     }
+    kfree(pcb[pid].fd_table);
+    pcb[pid].fd_table = NULL;
 
     return 0;
 }
 
 
+/*void reap_process()
+* Inputs: none
+* Return value: none
+* Function: Run by each context a CPU switches to (and by halt's return to
+* the parent). Frees the kernel stack of a process that ended itself on
+* this CPU, which nothing runs on anymore, and lets its pid go
+*/
+void reap_process(){
+    cpu_t* cpu = this_cpu();
+    int32_t pid = cpu->reap;
+
+    if(pid == -1) return;
+    cpu->reap = -1;
+    unmap_kstack(pid);
+    pcb[pid].flags = PCB_ABSENT;
+}
+
+
 /* void make_base_process();
  * Inputs: pid
  * Return Value: 0 for success, -1 for failure
  * Function: Turns process into base process */
 int32_t make_process_base(int pid){
     // Sanity checks
-    if(pid > PCB_SIZE-1 || pid < 0) return -1;
+    if(pid > num_pids-1 || pid < 0) return -1;
 
     pcb[pid].parent = -1;
     return 0;
@@ -146,10 +213,11 @@ int32_t add_fd(uint32_t fd_type, uint32_t inode_num){
     new_fd.inode = inode_num;
     new_fd.file_position = 0;
     new_fd.flags = FD_EXISTS;
+    new_fd.data = NULL;
     new_fd.file_operations_table = fileops_table[fd_type];
 
     // Get currently executing process
-    int sched_process = tmnl_block[exec_terminal].active_process;
+    int sched_process = exec_process;
 
     // Insert fd to PCB of executing process
     int i;
@@ -170,7 +238,7 @@ int32_t add_fd(uint32_t fd_type, uint32_t inode_num){
  * Function: Remove a file descriptor from the PCB */
 int32_t rem_fd(int32_t fd_idx){
     // Get currently executing process
-    int sched_process = tmnl_block[exec_terminal].active_process;
+    int sched_process = exec_process;
 
     // Remove fd from table, unless it already doesn't exist
     if(fd_idx < 2 || fd_idx > FDT_SIZE-1) return -1;
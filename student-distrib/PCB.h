@@ -6,13 +6,32 @@
 #include "lib.h"
 #include "terminal.h"
 #include "rtc_handler.h"
+#include "timer.h"
+#include "paging.h"
+#include "frame.h"
 
 #define FDT_SIZE        8
-#define PCB_SIZE        6
 #define ARG_SIZE        128
 
+// Each process owns a 16KB kernel stack (see map_kstack) and a page table
+// of 4KB pages
+#define KSTACK_SIZE     (KSTACK_PAGES * FOUR_KB)
+#define KSTACK_FRAMES   (KSTACK_SIZE / FRAME_SIZE)
+
+// Smallest footprint: kernel stack, page directory and table, one image
+// page and the stack
+#define PROC_FRAMES     (KSTACK_FRAMES + 2 + 1 + USER_STACK_PAGES)
+
+// Initial esp (and tss esp0) of a process's kernel stack
+#define KSTACK_TOP(pid) (pcb[pid].kstack + KSTACK_SIZE - 4)
+
 #define PCB_EXISTS      1
 #define PCB_ABSENT      0
+#define PCB_DEAD        2   // ended itself, slot held until its stack is freed
+
+#define PROC_READY      0
+#define PROC_BLOCKED    1
+#define PROC_NEW        2   // reserved by the scheduler, no program loaded yet
 
 #define FD_EXISTS       1
 #define FD_ABSENT       0
@@ -23,6 +42,7 @@ extern int32_t add_fd(uint32_t fd_type, uint32_t inode_num);
 extern int32_t rem_fd(int32_t fd_idx);
 int32_t create_process();
 int32_t end_process(int32_t pid);
+void reap_process();
 int32_t find_base_process(int32_t pid);
 void print_process_data(uint32_t idx);
 int32_t invalid_op();
@@ -33,7 +53,7 @@ typedef struct file_operations {
     //FIle ops table contains 4 pointers to 4 functions
     int32_t (*read) (int32_t, void*, int32_t);
     int32_t (*write) (int32_t, const void*, int32_t);
-    int32_t (*open) (const uint8_t*);
+    int32_t (*open) (const uint8_t*, int32_t);
     int32_t (*close) (int32_t);
 } file_op_t;
 
@@ -51,21 +71,45 @@ typedef struct file_descriptor {
     uint32_t inode;
     uint32_t file_position;
     uint32_t flags;
+    void* data;             // per-descriptor state of the file type
 } fd_t;
 
 // Process block
 typedef struct process_block {
-    fd_t fd_table[FDT_SIZE];
+    fd_t* fd_table;         // FDT_SIZE entries, kmalloc'd with the process
     int32_t parent;
     uint32_t stack_ptr;
     uint32_t base_ptr;
     uint32_t prev_sp;
-    uint32_t prev_bp;
+    int32_t forked;         // started by fork, no execute frame to return to
+    uint32_t kstack;        // kernel stack frames
+    uint32_t page_dir;      // kernel entries plus the ones below
+    uint32_t page_table;    // 4KB pages of the 128MB region
+    uint32_t user_pages;    // pages mapped in it
+    uint32_t image_inode;   // program file, read in on page faults
+    uint32_t image_len;
+    uint32_t image_end;     // end of the image and its bss
+    uint32_t image_rw;      // first page of the writable segments
+    uint32_t brk;           // end of the heap, which grows up from the image
+    uint32_t mmap_base;     // lowest file mapping, they grow down from the stack
     uint8_t argument[ARG_SIZE];
     uint32_t flags;
+    int32_t state;
+    int32_t level;
+    int32_t ticks_used;
+    uint32_t quantum_ms;
+    int32_t terminal;
+    int32_t cpu;            // CPU whose run queue the process goes back to
+    int32_t in_kernel;      // mode the process's CPU time is charged to
+    uint64_t user_cycles;
+    uint64_t kernel_cycles;
+    timer_t sleep_timer;    // armed while blocked in sleep
+    int32_t q_next;
+    int32_t q_prev;
 } pb_t;
 
-// Process control block
-pb_t pcb[PCB_SIZE];
+// Process control block, num_pids entries sized from RAM at boot
+extern pb_t* pcb;
+extern int32_t num_pids;
 
 #endif /* _PCB_H */
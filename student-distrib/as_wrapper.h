@@ -1,12 +1,21 @@
 #ifndef _AS_WRAPPER_H
 #define _AS_WRAPPER_H
 
+#include "types.h"
+
 #ifndef ASM
 
 extern void rtc_wrapper();
 extern void keyboard_wrapper();
 extern void syscall_wrapper();
 extern void sched_pit_wrapper();
+extern void sched_ipi_wrapper();
+extern void sched_timer_wrapper();
+extern void spurious_wrapper();
+extern void tlb_ipi_wrapper();
+extern void page_fault_wrapper();
+extern void fork_return();
+extern void switch_to(uint32_t* prev_sp, uint32_t next_sp);
 
 #endif /* ASM */
 
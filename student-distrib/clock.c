@@ -0,0 +1,185 @@
+#include "clock.h"
+#include "lib.h"
+#include "PCB.h"
+#include "scheduler.h"
+
+// Reference: https://wiki.osdev.org/TSC
+
+// TSC cycles per millisecond, calibrated at boot
+uint32_t tsc_per_ms;
+
+// TSC value at boot, the origin of clock_cycles
+static uint64_t boot_tsc = 0;
+
+static uint32_t div64(uint64_t n, uint32_t base);
+static void acct_charge(cpu_t* cpu, uint64_t now);
+
+
+/* void init_clock(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Calibrates the TSC against a CALIBRATE_MS one-shot of PIT
+ * channel 2 and starts CPU time accounting on the boot CPU */
+void init_clock(void){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    pit_oneshot_start(CALIBRATE_MS);
+    uint64_t start = rdtsc();
+    pit_oneshot_wait();
+    uint64_t elapsed = rdtsc() - start;
+
+    restore_flags(flags);
+
+    // 10 ms fit in 32 bits up to a 400 GHz TSC
+    tsc_per_ms = (uint32_t)elapsed / CALIBRATE_MS;
+    boot_tsc = start;
+    this_cpu()->acct_stamp = rdtsc();
+}
+
+
+/* void pit_oneshot_start(uint32_t ms);
+ * Inputs: ms - length of the one-shot, at most 54 ms
+ * Return Value: none
+ * Function: Loads and starts a one-shot on PIT channel 2 with the speaker
+ * disconnected. Channel 0 keeps ticking undisturbed */
+void pit_oneshot_start(uint32_t ms){
+    uint32_t pit_count = PIT_FREQ / 1000 * ms;
+
+    // Gate channel 2 off while the count is loaded
+    outb(inb(PIT_GATE_PORT) & ~(PIT_GATE2 | PIT_SPEAKER), PIT_GATE_PORT);
+    outb(OPM_CH2_ONESHOT, PIT_CMDR);
+    outb(pit_count & FREQ_MASK, PIT_CH2);
+    outb(pit_count >> 8, PIT_CH2);
+
+    outb(inb(PIT_GATE_PORT) | PIT_GATE2, PIT_GATE_PORT);
+}
+
+
+/* void pit_oneshot_wait(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Spins until channel 2's output goes high at the end of the one-shot */
+void pit_oneshot_wait(void){
+    while(!(inb(PIT_GATE_PORT) & PIT_OUT2));
+}
+
+
+/* uint64_t clock_cycles(void);
+ * Inputs: void
+ * Return Value: TSC cycles since boot
+ * Function: Monotonic clock, assuming the CPUs' TSCs run in step */
+uint64_t clock_cycles(void){
+    return rdtsc() - boot_tsc;
+}
+
+
+/* uint32_t clock_ms(void);
+ * Inputs: void
+ * Return Value: milliseconds since boot
+ * Function: Converts clock_cycles to milliseconds */
+uint32_t clock_ms(void){
+    return cycles_to_ms(clock_cycles());
+}
+
+
+/* uint32_t cycles_to_ms(uint64_t cycles);
+ * Inputs: cycles - TSC cycles
+ * Return Value: the same time in milliseconds
+ * Function: Converts with the calibrated TSC rate */
+uint32_t cycles_to_ms(uint64_t cycles){
+    return div64(cycles, tsc_per_ms);
+}
+
+
+/* void acct_switch(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Charges the outgoing context for its time on the CPU. Called
+ * by change_context before the switch */
+void acct_switch(void){
+    acct_charge(this_cpu(), rdtsc());
+}
+
+
+/* void acct_enter_kernel(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Charges the time since the last transition to user mode and
+ * starts charging the current process's kernel time (system call entry) */
+void acct_enter_kernel(void){
+    cpu_t* cpu = this_cpu();
+    acct_charge(cpu, rdtsc());
+    if(cpu->process != -1) pcb[cpu->process].in_kernel = 1;
+}
+
+
+/* void acct_enter_user(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Charges the time since the last transition to kernel mode and
+ * starts charging the current process's user time (system call exit) */
+void acct_enter_user(void){
+    cpu_t* cpu = this_cpu();
+    acct_charge(cpu, rdtsc());
+    if(cpu->process != -1) pcb[cpu->process].in_kernel = 0;
+}
+
+
+/* int32_t clock_get(int32_t pid, clock_info_t* info);
+ * Inputs: pid - process whose CPU time is read
+ *         info - filled with the clock and the CPU time of pid
+ * Return Value: 0 for success, -1 for failure
+ * Function: Samples the clock and the CPU time of a process. The calling
+ * CPU's current process is brought up to date first */
+int32_t clock_get(int32_t pid, clock_info_t* info){
+    if(pid < 0 || pid >= num_pids || pcb[pid].flags == PCB_ABSENT) return -1;
+
+    cpu_t* cpu = this_cpu();
+    uint64_t now = rdtsc();
+    if(cpu->process == pid) acct_charge(cpu, now);
+
+    info->now = now - boot_tsc;
+    info->user = pcb[pid].user_cycles;
+    info->kernel = pcb[pid].kernel_cycles;
+    info->cycles_per_ms = tsc_per_ms;
+    return 0;
+}
+
+
+/* void acct_charge(cpu_t* cpu, uint64_t now);
+ * Inputs: cpu - calling CPU
+ *         now - current TSC value
+ * Return Value: none
+ * Function: Adds the cycles since the CPU's last accounting stamp to the
+ * running context, in the mode it was in. Interrupts are charged to the
+ * mode they interrupted */
+static void acct_charge(cpu_t* cpu, uint64_t now){
+    uint64_t delta = now - cpu->acct_stamp;
+    int32_t pid = cpu->process;
+
+    if(pid == -1) cpu->idle_cycles += delta;
+    else if(pcb[pid].in_kernel) pcb[pid].kernel_cycles += delta;
+    else pcb[pid].user_cycles += delta;
+
+    cpu->acct_stamp = now;
+}
+
+
+/* uint32_t div64(uint64_t n, uint32_t base);
+ * Inputs: n - dividend
+ *         base - divisor
+ * Return Value: low 32 bits of n / base
+ * Function: 64-bit division in two divl steps, there is no libgcc to call */
+static uint32_t div64(uint64_t n, uint32_t base){
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t quot, rem;
+
+    if(base == 0) return 0;
+    rem = hi % base;
+    asm volatile("divl %4"
+                 : "=a"(quot), "=d"(rem)
+                 : "a"(lo), "d"(rem), "r"(base));
+    return quot;
+}
@@ -0,0 +1,37 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include "types.h"
+
+// PIT channel 2 one-shot, the reference the other clocks are calibrated against
+#define PIT_CH2         0x42
+#define PIT_GATE_PORT   0x61
+#define PIT_GATE2       0x01
+#define PIT_SPEAKER     0x02
+#define PIT_OUT2        0x20
+#define OPM_CH2_ONESHOT 0xB0
+#define CALIBRATE_MS    10
+
+// Filled in by the getclock system call, all times in TSC cycles
+typedef struct clock_info {
+    uint64_t now;               // cycles since boot
+    uint64_t user;              // cycles the caller spent in user mode
+    uint64_t kernel;            // cycles the caller spent in the kernel
+    uint32_t cycles_per_ms;
+} clock_info_t;
+
+void init_clock(void);
+void pit_oneshot_start(uint32_t ms);
+void pit_oneshot_wait(void);
+uint64_t clock_cycles(void);
+uint32_t clock_ms(void);
+uint32_t cycles_to_ms(uint64_t cycles);
+void acct_switch(void);
+void acct_enter_kernel(void);
+void acct_enter_user(void);
+int32_t clock_get(int32_t pid, clock_info_t* info);
+
+// TSC cycles per millisecond, calibrated at boot
+extern uint32_t tsc_per_ms;
+
+#endif /* _CLOCK_H */
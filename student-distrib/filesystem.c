@@ -3,7 +3,12 @@
 #include "scheduler.h"
 
 // Extern instantiation of PCB
-extern pb_t pcb[PCB_SIZE];
+extern pb_t* pcb;
+
+// File system structure
+boot_block_t* boot_block;
+inode_t* inodes;
+data_block_t* data_blocks;
 
 // File system boot block variables
 static uint32_t* fs_base_addr = NULL;
@@ -100,33 +105,27 @@ int32_t read_data(uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t length
 
     // getting appropriate inode
     uint32_t file_size = inodes[inode].length; 
-    int bytes_read = 0;
+    uint32_t bytes_read = 0;
 
     // getting which index for data block
     uint32_t data_idx = offset / BLOCK_SIZE; 
     if(data_idx >= INODE_DB) return -1;
 
-    // getting appropriate data block index and getting data block
-    uint32_t block_num = inodes[inode].inode_data[data_idx]; 
+    // stop at the end of the file
+    if(offset >= file_size) return 0;
+    if(length > file_size - offset) length = file_size - offset;
 
-    // getting where in the block we are supposed to read offset = 4096 2nd block 0th byte
-    int block_off = offset % BLOCK_SIZE; 
-    int i = 0;
-    int j = 0;
-    for(; i < length; i++)
+    // copy the run that falls in each block at once
+    // offset = 4096 is the 2nd block, 0th byte
+    while(bytes_read < length)
     {
-        // if we reached end of file, return number of bytes read
-        if(offset + bytes_read >= file_size) return bytes_read;
-
-        // if we reached end of the block, get next block, offset becomes 0 
-        if(block_off + i >= BLOCK_SIZE){
-            j++;
-            block_off = -i; 
-            block_num = inodes[inode].inode_data[data_idx+j];  
-        } 
-        // setting out buffer to appropriate val
-        buf[i] = data_blocks[block_num].data_entry[block_off + i]; 
-        bytes_read++;
+        uint32_t block_off = (offset + bytes_read) % BLOCK_SIZE;
+        uint32_t count = BLOCK_SIZE - block_off;
+        if(count > length - bytes_read) count = length - bytes_read;
+
+        uint32_t block_num = inodes[inode].inode_data[(offset + bytes_read) / BLOCK_SIZE];
+        memcpy(buf + bytes_read, &data_blocks[block_num].data_entry[block_off], count);
+        bytes_read += count;
     }
     return bytes_read;
 }
@@ -141,7 +140,7 @@ int32_t dir_read (int32_t fd, void* buf, int32_t nbytes){
     if(buf == NULL) return -1;
 
     // Get currently executing process
-    int sched_process = tmnl_block[exec_terminal].active_process;
+    int sched_process = exec_process;
     if(pcb[sched_process].fd_table[fd].file_position > num_dentries) return 0;
 
     // Retrieve original position for the current fd
@@ -180,11 +179,11 @@ int32_t dir_write(int32_t fd, const void* buf, int32_t nbytes){
 }
 
 
-/* int32_t dir_open (const uint8_t* filename);
- * Inputs: filename
+/* int32_t dir_open (const uint8_t* filename, int32_t fd);
+ * Inputs: filename, fd
  * Return value: 0 for success, -1 for failure
  * Function: Opens an instance of a directory */
-int32_t dir_open (const uint8_t* filename){
+int32_t dir_open (const uint8_t* filename, int32_t fd){
     return 0;
 }
 
@@ -204,7 +203,7 @@ int32_t dir_close (int32_t fd){
  * Function: Reads data from a file */
 int32_t file_read (int32_t fd, void* buf, int32_t nbytes){
     // Get currently executing process
-    int sched_process = tmnl_block[exec_terminal].active_process;
+    int sched_process = exec_process;
     fd_t curr_fdt = pcb[sched_process].fd_table[fd];
 
     if(curr_fdt.flags == PCB_ABSENT) return -1;
@@ -228,11 +227,11 @@ int32_t file_write (int32_t fd, const void* buf, int32_t nbytes){
 }
 
 
-/* int32_t file_open (const uint8_t* filename);
- * Inputs: filename
+/* int32_t file_open (const uint8_t* filename, int32_t fd);
+ * Inputs: filename, fd
  * Return value: 0 for success, -1 for failure
  * Function: Opens an instance of a file */
-int32_t file_open (const uint8_t* filename){
+int32_t file_open (const uint8_t* filename, int32_t fd){
     return 0;
 }
 
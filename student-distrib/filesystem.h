@@ -50,9 +50,9 @@ typedef struct boot_block {
 } boot_block_t;
 
 // File system structure
-boot_block_t* boot_block;
-inode_t* inodes;
-data_block_t* data_blocks;
+extern boot_block_t* boot_block;
+extern inode_t* inodes;
+extern data_block_t* data_blocks;
 
 
 void init_fs(uint32_t* start_addr);
@@ -63,12 +63,12 @@ int32_t read_data(uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t length
 
 int32_t dir_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t dir_write(int32_t fd, const void* buf, int32_t nbytes);
-int32_t dir_open(const uint8_t* filename);
+int32_t dir_open(const uint8_t* filename, int32_t fd);
 int32_t dir_close(int32_t fd);
 
 int32_t file_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t file_write(int32_t fd, const void* buf, int32_t nbytes);
-int32_t file_open(const uint8_t* filename);
+int32_t file_open(const uint8_t* filename, int32_t fd);
 int32_t file_close(int32_t fd);
 
 int32_t file_read_temp(const uint8_t* fname, uint8_t* buf, int32_t nbytes);
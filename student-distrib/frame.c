@@ -0,0 +1,238 @@
+#include "frame.h"
+#include "lib.h"
+#include "paging.h"
+
+// Reference: https://wiki.osdev.org/Page_Frame_Allocation
+
+#define BITS_PER_WORD   32
+#define WORD_FULL       0xFFFFFFFF
+
+// One bit per 4KB frame, set while the frame is in use or not RAM
+static uint32_t frame_bitmap[MAX_FRAMES / BITS_PER_WORD];
+
+// Frames at or above this are not RAM
+static uint32_t frame_limit = 0;
+static uint32_t free_count = 0;
+
+// Usable frames found in the memory map
+uint32_t frames_total;
+// End of the one to one kernel mapping, a multiple of 4MB
+uint32_t lowmem_end;
+// Extra owners of each frame (pages shared after fork), NULL until the
+// table is allocated at the end of init_frames
+static uint8_t* frame_refs = NULL;
+
+static void mark_frames(uint32_t first, uint32_t count, int used);
+static int32_t range_free(uint32_t first, uint32_t count);
+static uint32_t scan_frames(uint32_t start, uint32_t end, uint32_t count, uint32_t align);
+
+
+/* void init_frames(multiboot_info_t* mbi);
+ * Inputs: mbi - multiboot information, still reachable before paging is on
+ * Return Value: none
+ * Function: Marks the RAM listed in the multiboot memory map as free, then
+ * reserves low memory, the kernel's 4MB page and the boot modules */
+void init_frames(multiboot_info_t* mbi){
+    memset(frame_bitmap, 0xFF, sizeof(frame_bitmap));
+
+    if(mbi->flags & (1 << 6)){
+        memory_map_t* mmap;
+        for(mmap = (memory_map_t*)mbi->mmap_addr;
+                (uint32_t)mmap < mbi->mmap_addr + mbi->mmap_length;
+                mmap = (memory_map_t*)((uint32_t)mmap + mmap->size + sizeof(mmap->size))){
+            // Only usable RAM below 4GB
+            if(mmap->type != 1 || mmap->base_addr_high != 0) continue;
+
+            uint32_t base = mmap->base_addr_low;
+            uint32_t end = base + mmap->length_low;
+            if(mmap->length_high != 0 || end < base) end = 0xFFFFF000;
+
+            uint32_t first = (base + FRAME_SIZE - 1) >> FRAME_SHIFT;
+            uint32_t last = end >> FRAME_SHIFT;
+            if(last > first) mark_frames(first, last - first, 0);
+            if(last > frame_limit) frame_limit = last;
+        }
+    }
+    else if(mbi->flags & 1){
+        // No map, mem_upper KB of RAM start at 1MB
+        uint32_t first = OFF_1MB >> FRAME_SHIFT;
+        frame_limit = first + (mbi->mem_upper >> 2);
+        mark_frames(first, frame_limit - first, 0);
+    }
+
+    // Low memory and the kernel's page
+    mark_frames(0, OFF_8MB >> FRAME_SHIFT, 1);
+
+    if(mbi->flags & (1 << 3)){
+        module_t* mod = (module_t*)mbi->mods_addr;
+        uint32_t i;
+        for(i=0; i < mbi->mods_count; i++, mod++){
+            uint32_t first = mod->mod_start >> FRAME_SHIFT;
+            uint32_t last = (mod->mod_end + FRAME_SIZE - 1) >> FRAME_SHIFT;
+            if(last > frame_limit) last = frame_limit;
+            if(last > first) mark_frames(first, last - first, 1);
+        }
+    }
+
+    // Map whole 4MB pages, frames past frame_limit are never handed out
+    if(frame_limit >= (LOWMEM_MAX >> FRAME_SHIFT)) lowmem_end = LOWMEM_MAX;
+    else lowmem_end = ((frame_limit << FRAME_SHIFT) + OFF_4MB - 1) & ~(OFF_4MB - 1);
+
+    // One count per frame, taken from the allocator itself
+    frame_refs = kalloc_frames(frame_limit);
+
+    frames_total = free_count;
+}
+
+
+/* uint32_t alloc_frames(uint32_t count, uint32_t align, uint32_t flags);
+ * Inputs: count - contiguous frames wanted
+ *         align - alignment of the first frame, in frames (a power of two)
+ *         flags - FRAME_LOW for memory the kernel reads and writes itself
+ * Return Value: physical address of the first frame, 0 if none are free
+ * Function: First fit allocation. Other requests try memory above
+ * lowmem_end first, to keep the kernel's memory for the kernel */
+uint32_t alloc_frames(uint32_t count, uint32_t align, uint32_t flags){
+    uint32_t low = lowmem_end >> FRAME_SHIFT;
+    uint32_t first = 0;
+
+    if(count == 0) return 0;
+    if(align == 0) align = 1;
+
+    if(!(flags & FRAME_LOW)) first = scan_frames(low, frame_limit, count, align);
+    if(first == 0) first = scan_frames(0, (low < frame_limit) ? low : frame_limit, count, align);
+    if(first == 0) return 0;
+
+    mark_frames(first, count, 1);
+    return first << FRAME_SHIFT;
+}
+
+
+/* void free_frames(uint32_t addr, uint32_t count);
+ * Inputs: addr - address returned by alloc_frames
+ *         count - frames allocated there
+ * Return Value: none
+ * Function: Gives frames back to the allocator. A shared frame just loses
+ * one owner */
+void free_frames(uint32_t addr, uint32_t count){
+    uint32_t first = addr >> FRAME_SHIFT;
+    uint32_t i;
+
+    if(addr == 0) return;
+    for(i=first; i < first + count; i++){
+        if(frame_refs != NULL && i < frame_limit && frame_refs[i] != 0) frame_refs[i]--;
+        else mark_frames(i, 1, 0);
+    }
+}
+
+
+/* int32_t share_frame(uint32_t addr);
+ * Inputs: addr - allocated frame
+ * Return Value: 0 for success, -1 if the frame has too many owners
+ * Function: Adds an owner to a frame, free_frames must then be called
+ * once per owner */
+int32_t share_frame(uint32_t addr){
+    uint32_t i = addr >> FRAME_SHIFT;
+    if(frame_refs == NULL || i >= frame_limit || frame_refs[i] == FRAME_REFS_MAX) return -1;
+    frame_refs[i]++;
+    return 0;
+}
+
+
+/* uint32_t frame_owners(uint32_t addr);
+ * Inputs: addr - allocated frame
+ * Return Value: number of owners of the frame
+ * Function: Tells a write fault whether a shared page has to be copied */
+uint32_t frame_owners(uint32_t addr){
+    uint32_t i = addr >> FRAME_SHIFT;
+    if(frame_refs == NULL || i >= frame_limit) return 1;
+    return frame_refs[i] + 1;
+}
+
+
+/* void* kalloc_frames(uint32_t bytes);
+ * Inputs: bytes - size of the table
+ * Return Value: zeroed kernel memory, NULL if none is free
+ * Function: Allocates whole frames for a kernel table sized at boot */
+void* kalloc_frames(uint32_t bytes){
+    uint32_t count = (bytes + FRAME_SIZE - 1) >> FRAME_SHIFT;
+    uint32_t addr = alloc_frames(count, 1, FRAME_LOW);
+    if(addr == 0) return NULL;
+
+    memset((void*)addr, 0, count << FRAME_SHIFT);
+    return (void*)addr;
+}
+
+
+/* uint32_t frames_free(void);
+ * Inputs: void
+ * Return Value: number of free frames
+ * Function: Reports the allocator's free count */
+uint32_t frames_free(void){
+    return free_count;
+}
+
+
+/* uint32_t scan_frames(uint32_t start, uint32_t end, uint32_t count, uint32_t align);
+ * Inputs: start, end - frame range to search
+ *         count, align - as for alloc_frames
+ * Return Value: first frame of a free run, 0 if there is none
+ * Function: Walks the bitmap, skipping whole words that are in use.
+ * Frame 0 is never free, so 0 can mean failure */
+static uint32_t scan_frames(uint32_t start, uint32_t end, uint32_t count, uint32_t align){
+    uint32_t first = (start + align - 1) & ~(align - 1);
+
+    while(first + count <= end){
+        if(frame_bitmap[first / BITS_PER_WORD] == WORD_FULL){
+            first = ((first / BITS_PER_WORD + 1) * BITS_PER_WORD + align - 1) & ~(align - 1);
+            continue;
+        }
+        if(range_free(first, count)) return first;
+        first += align;
+    }
+    return 0;
+}
+
+
+/* int32_t range_free(uint32_t first, uint32_t count);
+ * Inputs: first, count - frame range
+ * Return Value: 1 if every frame in the range is free, 0 otherwise
+ * Function: Checks whole words where the range covers them */
+static int32_t range_free(uint32_t first, uint32_t count){
+    uint32_t i = first;
+    uint32_t end = first + count;
+
+    while(i < end){
+        if(i % BITS_PER_WORD == 0 && end - i >= BITS_PER_WORD){
+            if(frame_bitmap[i / BITS_PER_WORD] != 0) return 0;
+            i += BITS_PER_WORD;
+            continue;
+        }
+        if(frame_bitmap[i / BITS_PER_WORD] & (1 << (i % BITS_PER_WORD))) return 0;
+        i++;
+    }
+    return 1;
+}
+
+
+/* void mark_frames(uint32_t first, uint32_t count, int used);
+ * Inputs: first, count - frame range
+ *         used - 1 to allocate, 0 to free
+ * Return Value: none
+ * Function: Sets or clears the range's bits, keeping the free count */
+static void mark_frames(uint32_t first, uint32_t count, int used){
+    uint32_t i;
+    for(i=first; i < first + count && i < MAX_FRAMES; i++){
+        uint32_t bit = 1 << (i % BITS_PER_WORD);
+        uint32_t* word = &frame_bitmap[i / BITS_PER_WORD];
+
+        if(used && !(*word & bit)){
+            *word |= bit;
+            free_count--;
+        }
+        else if(!used && (*word & bit)){
+            *word &= ~bit;
+            free_count++;
+        }
+    }
+}
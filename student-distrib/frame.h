@@ -0,0 +1,36 @@
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include "types.h"
+#include "multiboot.h"
+
+#define FRAME_SIZE      4096
+#define FRAME_SHIFT     12
+#define MAX_FRAMES      0x100000    // 4GB of frames
+#define FRAMES_4MB      1024
+
+// Physical memory below this is mapped one to one in the kernel's view
+// (the user program page starts at 128MB virtual)
+#define LOWMEM_MAX      0x8000000
+
+// alloc_frames flags
+#define FRAME_LOW       0x1         // kernel accessible (below lowmem_end)
+
+// Extra owners a frame can have
+#define FRAME_REFS_MAX  0xFF
+
+void init_frames(multiboot_info_t* mbi);
+uint32_t alloc_frames(uint32_t count, uint32_t align, uint32_t flags);
+void free_frames(uint32_t addr, uint32_t count);
+int32_t share_frame(uint32_t addr);
+uint32_t frame_owners(uint32_t addr);
+void* kalloc_frames(uint32_t bytes);
+uint32_t frames_free(void);
+
+// Usable frames found in the memory map
+extern uint32_t frames_total;
+
+// End of the one to one kernel mapping, a multiple of 4MB
+extern uint32_t lowmem_end;
+
+#endif /* _FRAME_H */
@@ -17,18 +17,64 @@
 #include "syscall.h"
 #include "terminal.h"
 #include "scheduler.h"
+#include "smp.h"
+#include "clock.h"
+#include "timer.h"
+#include "frame.h"
 
 #define RUN_TESTS
 
 static uint32_t* fs_addr;
 
+// Scheduler tick rate requested on the command line (0 if not given)
+static uint32_t boot_tick_hz = 0;
+
+// Set by "clock=pit" to keep the PIT driving preemption
+static int boot_use_pit = 0;
+
 // Extern declaration of process control block
-extern pb_t pcb[PCB_SIZE];
+extern pb_t* pcb;
 
 /* Macros. */
 /* Check if the bit BIT in FLAGS is set. */
 #define CHECK_FLAG(flags, bit)   ((flags) & (1 << (bit)))
 
+/* Find option OPT on the boot command line. Options are separated by
+   spaces, so OPT only matches at the start of one. An OPT without a
+   value ("clock=pit") must also make up the whole option.
+   Returns a pointer just past it, or NULL if it is absent. */
+static const int8_t* find_option(const int8_t* cmdline, const int8_t* opt) {
+    uint32_t len = strlen(opt);
+    const int8_t* start = cmdline;
+
+    while (*cmdline != '\0') {
+        if ((cmdline == start || cmdline[-1] == ' ') &&
+            strncmp((uint8_t*)cmdline, (uint8_t*)opt, len) == 0 &&
+            (opt[len - 1] == '=' || cmdline[len] == ' ' || cmdline[len] == '\0'))
+            return cmdline + len;
+        cmdline++;
+    }
+    return NULL;
+}
+
+/* Parse the "tick=<hz>" option from the boot command line.
+   Returns 0 if the option is absent or malformed. */
+static uint32_t parse_tick_option(const int8_t* cmdline) {
+    const int8_t* val = find_option(cmdline, (int8_t*)"tick=");
+    uint32_t hz = 0;
+
+    if (val == NULL)
+        return 0;
+    while (*val >= '0' && *val <= '9') {
+        hz = hz * 10 + (*val - '0');
+        val++;
+    }
+    /* The value runs to the next space */
+    if (*val != ' ' && *val != '\0')
+        return 0;
+    return hz;
+}
+
 /* Check if MAGIC is valid and print the Multiboot information structure
    pointed by ADDR. */
 void entry(unsigned long magic, unsigned long addr) {
@@ -59,8 +105,11 @@ void entry(unsigned long magic, unsigned long addr) {
         printf("boot_device = 0x%#x\n", (unsigned)mbi->boot_device);
 
     /* Is the command line passed? */
-    if (CHECK_FLAG(mbi->flags, 2))
+    if (CHECK_FLAG(mbi->flags, 2)) {
         printf("cmdline = %s\n", (char *)mbi->cmdline);
+        boot_tick_hz = parse_tick_option((int8_t *)mbi->cmdline);
+        boot_use_pit = find_option((int8_t *)mbi->cmdline, (int8_t *)"clock=pit") != NULL;
+    }
 
     if (CHECK_FLAG(mbi->flags, 3)) {
         int mod_count = 0;
@@ -165,9 +214,13 @@ void entry(unsigned long magic, unsigned long addr) {
     i8259_init();
     printf("Initialized PIC\n");
 
+    //Initialize the frame allocator while the memory map is still reachable
+    init_frames(mbi);
+    printf("Initialized frames (%u KB free)\n", frames_free() * (FRAME_SIZE / 1024));
+
     //Initialize PCB
     init_pcb();
-    printf("Initialized PCB\n");
+    printf("Initialized PCB (%d processes)\n", num_pids);
 
     /* Init page directory and setup*/
     init_paging();
@@ -185,6 +238,11 @@ void entry(unsigned long magic, unsigned long addr) {
     init_fs(fs_addr);
     printf("Initialized filesystem\n");
 
+    //Calibrate the TSC clock
+    init_clock();
+    printf("Initialized clock (%u cycles/ms)\n", tsc_per_ms);
+    init_timers();
+
     /* Enable interrupts */
     /* Do not enable the following until after you have set up your
      * IDT correctly otherwise QEMU will triple fault and simple close
@@ -195,19 +253,30 @@ void entry(unsigned long magic, unsigned long addr) {
     init_terminal();
 
     init_scheduler();
-    sti();
+    if (boot_tick_hz != 0 && sched_set_tick(boot_tick_hz) == -1)
+        printf("Ignoring invalid tick rate %u Hz\n", boot_tick_hz);
 
+    // Start the other CPUs, they idle until this one does
+    init_smp();
+
+    // Per-CPU local APIC timers take over preemption from the PIT
+    if (!boot_use_pit && sched_use_lapic() == -1)
+        printf("No local APIC timer, scheduling from the PIT\n");
 
 #ifdef RUN_TESTS
-    /* Run tests */
+    /* Run tests, before the first tick starts the shells */
     launch_tests();
 #endif
+
+    sti();
+
     /* Execute the first program ("shell") ... */
 
     //execute((uint8_t*)"shell");
     
     
 
-    /* Spin (nicely, so we don't chew up cycles) */
-    asm volatile (".1: hlt; jmp .1;");
+    /* Become the idle task: start the shells, then halt (nicely, so we
+     * don't chew up cycles) whenever nothing is runnable */
+    sched_idle();
 }
@@ -6,6 +6,8 @@
 #include "paging.h"
 #include "PCB.h"
 #include "scheduler.h"
+#include "rtc_handler.h"
+#include "slab.h"
 
 #define KBCODE_SIZE     62
 #define SHIFTCODE_SIZE  100
@@ -176,6 +178,13 @@ void keyboard_handler(void)
             clear();
             printf("%s", tmnl_block[active_terminal].buffer);
         }
+        // Dump scheduler statistics
+        else if(kb_char == 's'){
+            print_sched_stats();
+            print_rtc_stats();
+            print_mem_stats();
+            print_slab_stats();
+        }
         exec_terminal = temp;
         return;
     }
@@ -214,8 +223,9 @@ void keyboard_handler(void)
             tmnl_block[active_terminal].buffer_size++;
             printf("\n");
             
-            // Signal enter flag for active terminal
+            // Signal enter flag for active terminal and wake its reader
             tmnl_block[active_terminal].enter_flag = KB_PRESSED;
+            terminal_wake(active_terminal);
         }
         // Handle backspace
         else if(kb_char==BACKSPACE)
@@ -6,6 +6,8 @@
 #include "scheduler.h"
 
 
+int screen_x;
+int screen_y;
 static char* video_mem = (char *)VIDEO;
 static int start_x = 0;
 static int start_y = 0;
@@ -208,7 +210,8 @@ int32_t puts(int8_t* s) {
  * Return Value: void
  *  Function: Output a character to the console */
 void putc(uint8_t c) {
-    if(active_terminal==exec_terminal)
+    // Kernel messages printed outside any terminal (at boot) go to the screen
+    if(active_terminal==exec_terminal || exec_terminal == -1)
     {
         if(c == '\n' || c == '\r') {
             if(screen_y >= NUM_ROWS - 1){
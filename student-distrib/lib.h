@@ -20,8 +20,8 @@
 #define ATTRIB_TERM2 0x04
 #define ATTRIB_TERM3 0x02
 
-int screen_x;
-int screen_y;
+extern int screen_x;
+extern int screen_y;
 
 void test_interrupts(void);
 
@@ -124,6 +124,17 @@ do {                                    \
     );                                  \
 } while (0)
 
+/* Read the time stamp counter (cycles since reset) */
+static inline uint64_t rdtsc(void) {
+    uint64_t val;
+    asm volatile ("rdtsc"
+            : "=A"(val)
+            :
+            : "memory"
+    );
+    return val;
+}
+
 /* Clear interrupt flag - disables interrupts on this processor */
 #define cli()                           \
 do {                                    \
@@ -2,20 +2,99 @@
 #include "types.h"
 #include "filesystem.h"
 #include "lib.h"
+#include "smp.h"
+#include "frame.h"
+#include "PCB.h"
+#include "syscall.h"
+#include "slab.h"
+#include "terminal.h"
+#include "set_idt.h"
 
 void create_pages();
 void init_paging();
 
-// Page directory
+// Start address of user program
+uint8_t* program_start;
+
+// Start address of terminal video instances
+uint32_t terminal_start;
+
+// Start address of video memory
+uint32_t video_start;
+
+// TLB maintenance counters
+uint32_t tlb_flushes;
+uint32_t tlb_invlpgs;
+uint32_t tlb_skips;
+
+// Program pages filled on first touch, mapped straight from the
+// filesystem image, copied when first written, and taken over on a
+// write by their last owner
+uint32_t demand_faults;
+uint32_t fs_mapped_pages;
+uint32_t cow_copies;
+uint32_t cow_reuses;
+
+// File pages mapped by mmap straight from the filesystem, and copied
+uint32_t mmap_direct;
+uint32_t mmap_copied;
+
+// Text cache pages loaded and mapped again by another process
+uint32_t text_pages;
+uint32_t text_hits;
+
+// Kernel page directory, loaded at boot and by idle CPUs. Each process's
+// directory starts as a copy of it
 uint32_t page_directory[PAGE_SIZE] __attribute__((aligned (FOUR_KB)));
 
-// Page tables for vidmap (user and kernel mappings)
+// Page tables for video memory (kernel and vidmap mappings)
+// The kernel table is shared, vidmap has one table per terminal
 uint32_t page_table[PAGE_SIZE] __attribute__((aligned (FOUR_KB))); 
-uint32_t page_table_2[PAGE_SIZE] __attribute__((aligned (FOUR_KB)));
+uint32_t vidmap_table[NUM_TERMINAL][PAGE_SIZE] __attribute__((aligned (FOUR_KB)));
 
 // Page table for user process
 uint32_t process_page[PAGE_SIZE] __attribute__((aligned (FOUR_KB)));
 
+// Page tables of the kernel stack region, one after another. The
+// directory entries pointing at them are copied into every process's
+static uint32_t* kstack_tables;
+
+// Text cache, hashed by inode
+static text_page_t* text_cache[TEXT_BUCKETS];
+
+static int32_t map_text_page(int32_t pid, uint32_t addr, uint32_t offset);
+static void release_text_page(uint32_t inode, uint32_t offset, uint32_t frame);
+static void unmap_file_pages(int32_t pid, uint32_t base, uint32_t count);
+
+
+/* void load_page_dir(uint32_t dir);
+ * Inputs: dir - page directory to switch to
+ * Return Value: none
+ * Function: Loads cr3 unless dir is already loaded, in which case the
+ * cached translations are still valid */
+static inline void load_page_dir(uint32_t dir)
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if(cr3 == dir){
+        tlb_skips++;
+        return;
+    }
+    tlb_flushes++;
+    asm volatile("mov %0, %%cr3" : : "r"(dir) : "memory");
+}
+
+
+/* void invlpg(uint32_t addr);
+ * Inputs: addr - virtual address whose mapping changed
+ * Return Value: none
+ * Function: Drops the cached translation of a single page */
+static inline void invlpg(uint32_t addr)
+{
+    tlb_invlpgs++;
+    asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
 
 /* void creates_pages();
  * Inputs: none
@@ -39,26 +118,55 @@ void create_pages()
     for(j=0;j<PAGE_SIZE;j++)
     {
         // Setting supervisor level and read-write
-        page_table[i]=offset|0x6; 
+        page_table[j]=offset|0x6; 
         offset+=FOUR_KB;
     }
     // Setting supervisor level read write and present for vid memory
-    page_table[VM_ADDR]=(FOUR_KB*VM_ADDR)|0x7;
+    // Global so the kernel's view of video memory survives cr3 reloads
+    page_table[VM_ADDR]=(FOUR_KB*VM_ADDR)|0x7|PAGE_GLOBAL;
 
     // Setup page tables for terminal video memories
     // Terminal 0 mapped to VM_ADDR+1
     // Terminal 1 mapped to VM_ADDR+2
     // Terminal 2 mapped to VM_ADDR+3
-    page_table[VM_ADDR+1] = (FOUR_KB*(VM_ADDR+1))|0x7;
-    page_table[VM_ADDR+2] = (FOUR_KB*(VM_ADDR+2))|0x7;
-    page_table[VM_ADDR+3] = (FOUR_KB*(VM_ADDR+3))|0x7;
+    page_table[VM_ADDR+1] = (FOUR_KB*(VM_ADDR+1))|0x7|PAGE_GLOBAL;
+    page_table[VM_ADDR+2] = (FOUR_KB*(VM_ADDR+2))|0x7|PAGE_GLOBAL;
+    page_table[VM_ADDR+3] = (FOUR_KB*(VM_ADDR+3))|0x7|PAGE_GLOBAL;
     terminal_start = FOUR_KB*(VM_ADDR+1);
 
     // Setting top 20 bits to address and read write and present bits
     page_directory[0]= (uint32_t)page_table | 0x3; 
 
     // Setting the appropriate size bit address bit read write supervisor etc
-    page_directory[1]=0x400083; 
+    // The kernel page is the same in every address space, so mark it global
+    page_directory[1]=0x400083|PAGE_GLOBAL; 
+
+    // The rest of low memory is mapped one to one the same way, so the
+    // kernel can use the frames it allocates for itself (see frame.c)
+    for(i=2;i<(lowmem_end>>22);i++)
+    {
+        page_directory[i]=(i<<22)|0x83|PAGE_GLOBAL;
+    }
+
+    // Enough kernel stack slots for every pid. Without them no process
+    // can be created
+    uint32_t tables = (num_pids * (KSTACK_SLOT / FOUR_KB) + PAGE_SIZE - 1) / PAGE_SIZE;
+    kstack_tables = kalloc_frames(tables * FOUR_KB);
+    if(kstack_tables == NULL) num_pids = 0;
+    for(i=0;i<tables && kstack_tables != NULL;i++)
+    {
+        page_directory[KSTACK_PDE+i]=((uint32_t)kstack_tables+i*FOUR_KB)|0x3;
+    }
+
+    // Vidmap pages show each terminal's backing page until one is active
+    for(i=0;i<NUM_TERMINAL;i++)
+    {
+        for(j=0;j<PAGE_SIZE;j++)
+        {
+            vidmap_table[i][j]=0x2;
+        }
+    }
+    remap_vidmem();
 }
 
 
@@ -86,52 +194,527 @@ void init_paging()
 
         "movl %%cr0,%%ebx;"
         "orl $0x80000000,%%ebx;"
+        "orl %2,%%ebx;"
         "movl %%ebx,%%cr0;"
+
+        // PGE must be set after paging is on
+        "movl %%cr4,%%ebx;"
+        "orl %1,%%ebx;"
+        "movl %%ebx,%%cr4;"
           :
-          : "r"(page_directory)   
+          : "r"(page_directory), "i"(CR4_PGE), "i"(CR0_WP)
+          : "%ebx"
     );
 }
 
 
-/*int32_t create_process_page(uint32_t pid)
+/*uint32_t create_page_dir(uint32_t table)
+* Inputs: table - page table of the new process's 128MB region
+* Return value: the process's page directory, 0 if out of memory
+* Function: Copies the kernel entries and points the 128MB region at the
+* process's page table with the user, read-write and present bits
+*/
+uint32_t create_page_dir(uint32_t table)
+{
+    uint32_t* dir = kalloc_frames(FRAME_SIZE);
+    if(dir == NULL) return 0;
+
+    memcpy(dir, page_directory, FOUR_KB);
+    dir[USER_PDE] = table | PAGE_USER;
+    return (uint32_t)dir;
+}
+
+
+/*void create_process_page(uint32_t pid)
 * Inputs: pid
 * Return value: none
-* Function: Restructures PD for current process */
+* Function: Switches the CPU to the process's address space, a single
+* cr3 load whatever its size */
 void create_process_page(uint32_t pid)
 {
-    // setting 128 MB in virtual address space to the correct process id
-    page_directory[32] = 0x0800000 + pid*0x400000;
-    
-    // setting the read-write and present and size bits
-    page_directory[32] |= 0x87;
+    load_page_dir(pcb[pid].page_dir);
+}
 
-    // flushing the tlb
-    asm volatile(
-                 "mov %%cr3, %%eax;"
-                 "mov %%eax, %%cr3;"
-                 :                      
-                 :                     
-                 :"%eax"                
-                 );
-}
-
-
-/*int32_t load_prog(uint32_t inode_num, uint32_t entry_point)
-* Inputs: inode_num, entry_point
-* Return value: bytes read through read_data
-* Function: Loads user program into virtual memory */
-int32_t load_prog(uint32_t inode_num){
-        asm volatile(
-            "mov %%cr3, %%eax;"
-            "mov %%eax, %%cr3;"
-                :                      
-                :                     
-                :"%eax"                
-                );
-    int32_t ret = read_data(inode_num, 0, program_start, OFF_4MB);
+
+/*void use_kernel_page_dir()
+* Inputs: none
+* Return value: none
+* Function: Switches an idle CPU to the kernel's directory, so no CPU is
+* left on the directory of a process that ends */
+void use_kernel_page_dir()
+{
+    load_page_dir((uint32_t)page_directory);
+}
+
+
+/*int32_t map_user_pages(int32_t pid, uint32_t addr, uint32_t count)
+* Inputs: pid - process whose page table is current on this CPU
+*         addr - user address of the first page
+*         count - number of 4KB pages
+* Return value: 0 for success, -1 if out of memory
+* Function: Backs a range of the 128MB region with zeroed frames, leaving
+* pages that are already mapped alone
+*/
+int32_t map_user_pages(int32_t pid, uint32_t addr, uint32_t count)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+    uint32_t idx = (addr - OFF_128MB) / FOUR_KB;
+
+    for(; count > 0 && idx < PAGE_SIZE; count--, idx++){
+        if(table[idx] & 0x1) continue;
+
+        uint32_t frame = alloc_frames(1, 1, 0);
+        if(frame == 0) return -1;
+
+        // Not present entries are never cached, so no invalidation needed
+        table[idx] = frame | PAGE_USER;
+        pcb[pid].user_pages++;
+        memset((void*)(OFF_128MB + idx * FOUR_KB), 0, FOUR_KB);
+    }
+    return 0;
+}
+
+
+/*void free_user_pages(int32_t pid)
+* Inputs: pid - ending process
+* Return value: none
+* Function: Frees every page of a process, its page table and directory.
+* Only the CPU ending the process may still have the directory loaded,
+* and it switches away before anything else can reuse it
+*/
+void free_user_pages(int32_t pid)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+    int i;
+
+    if(table == NULL) return;
+    for(i=0; i < PAGE_SIZE; i++){
+        // Filesystem blocks are only borrowed
+        if(!(table[i] & 0x1) || (table[i] & PAGE_FS)) continue;
+
+        uint32_t frame = table[i] & ~(FOUR_KB-1);
+        free_frames(frame, 1);
+
+        // Drop a text page once only the cache holds it
+        if((table[i] & PAGE_TEXT) && frame_owners(frame) == 1){
+            release_text_page(pcb[pid].image_inode, OFF_128MB + i * FOUR_KB - (uint32_t)program_start, frame);
+        }
+    }
+
+    free_frames(pcb[pid].page_table, 1);
+    free_frames(pcb[pid].page_dir, 1);
+    pcb[pid].page_table = 0;
+    pcb[pid].page_dir = 0;
+    pcb[pid].user_pages = 0;
+}
+
+
+/*int32_t user_page_valid(int32_t pid, uint32_t addr)
+* Inputs: pid, addr - user address
+* Return value: 1 if the page is mapped or may be faulted in, 0 otherwise
+* Function: Checks an address against the process's image, heap and stack
+*/
+int32_t user_page_valid(int32_t pid, uint32_t addr)
+{
+    if(addr < OFF_128MB || addr >= OFF_128MB + OFF_4MB) return 0;
+    if(((uint32_t*)pcb[pid].page_table)[(addr - OFF_128MB) / FOUR_KB] & 0x1) return 1;
+    if(addr >= (uint32_t)program_start && addr < pcb[pid].brk) return 1;
+    return addr >= USER_STACK_BOTTOM;
+}
+
+
+/*int32_t user_range_ok(int32_t pid, uint32_t addr, uint32_t len)
+* Inputs: pid, addr - start of a user buffer, len - its size in bytes
+* Return value: 1 if the whole buffer lies in valid pages, 0 otherwise
+* Function: Validates system call buffers before the kernel touches them.
+* Pages not loaded yet are faulted in on the kernel's first access
+*/
+int32_t user_range_ok(int32_t pid, uint32_t addr, uint32_t len)
+{
+    uint32_t end = addr + len;
+
+    if(pid == -1 || len == 0 || end < addr) return 0;
+    for(addr &= ~(FOUR_KB-1); addr < end; addr += FOUR_KB){
+        if(!user_page_valid(pid, addr)) return 0;
+    }
+    return 1;
+}
+
+
+/*int32_t demand_page(int32_t pid, uint32_t addr)
+* Inputs: pid - process whose page table is current, addr - faulting address
+* Return value: 0 if the page was mapped, -1 if the address is invalid or
+* memory ran out
+* Function: Page fault path. A page filled entirely from one page aligned
+* block of the filesystem image maps that block read-only (copied on write
+* if the page is writable). Other read-only image pages come from the text
+* cache. The rest get a zeroed frame with the part of the program file
+* that falls in them copied in
+*/
+int32_t demand_page(int32_t pid, uint32_t addr)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+
+    if(!user_page_valid(pid, addr)) return -1;
+
+    addr &= ~(FOUR_KB-1);
+    demand_faults++;
+
+    // Image pages line up with file offsets from program_start
+    uint32_t offset = addr - (uint32_t)program_start;
+    if(addr >= (uint32_t)program_start && offset + FOUR_KB <= pcb[pid].image_len){
+        uint32_t block = (uint32_t)&data_blocks[inodes[pcb[pid].image_inode].inode_data[offset / BLOCK_SIZE]];
+        if(!(block & (FOUR_KB-1))){
+            table[(addr - OFF_128MB) / FOUR_KB] = block | PAGE_USER_RO | PAGE_FS;
+            fs_mapped_pages++;
+            return 0;
+        }
+    }
+    if(addr >= (uint32_t)program_start && offset < pcb[pid].image_len && addr < pcb[pid].image_rw){
+        if(map_text_page(pid, addr, offset) == 0) return 0;
+    }
+
+    if(map_user_pages(pid, addr, 1) == -1) return -1;
+    if(addr >= (uint32_t)program_start && offset < pcb[pid].image_len){
+        uint32_t len = pcb[pid].image_len - offset;
+        if(len > FOUR_KB) len = FOUR_KB;
+        read_data(pcb[pid].image_inode, offset, (uint8_t*)addr, len);
+    }
+    return 0;
+}
+
+
+/*int32_t map_text_page(int32_t pid, uint32_t addr, uint32_t offset)
+* Inputs: pid - process whose page table is current
+*         addr - read-only image page, offset - its file offset
+* Return value: 0 if the page was mapped, -1 if memory ran out
+* Function: Maps the text cache's copy of a program page, loading it the
+* first time any process needs it
+*/
+static int32_t map_text_page(int32_t pid, uint32_t addr, uint32_t offset)
+{
+    uint32_t inode = pcb[pid].image_inode;
+    text_page_t** bucket = &text_cache[inode % TEXT_BUCKETS];
+    text_page_t* text;
+
+    for(text = *bucket; text != NULL; text = text->next){
+        if(text->inode == inode && text->offset == offset) break;
+    }
+
+    if(text != NULL){
+        if(share_frame(text->frame) == -1) return -1;
+        text_hits++;
+    }
+    else{
+        text = kmalloc(sizeof(text_page_t));
+        if(text == NULL) return -1;
+        text->frame = alloc_frames(1, 1, FRAME_LOW);
+        if(text->frame == 0){
+            kfree(text);
+            return -1;
+        }
+
+        // Filled through the kernel's view, the process gets it read-only
+        uint32_t len = pcb[pid].image_len - offset;
+        if(len > FOUR_KB) len = FOUR_KB;
+        memset((void*)text->frame, 0, FOUR_KB);
+        read_data(inode, offset, (uint8_t*)text->frame, len);
+
+        // One owner for the cache, one for the process
+        text->inode = inode;
+        text->offset = offset;
+        text->next = *bucket;
+        *bucket = text;
+        share_frame(text->frame);
+        text_pages++;
+    }
+
+    ((uint32_t*)pcb[pid].page_table)[(addr - OFF_128MB) / FOUR_KB] = text->frame | PAGE_USER_RO | PAGE_TEXT;
+    return 0;
+}
+
+
+/*void release_text_page(uint32_t inode, uint32_t offset, uint32_t frame)
+* Inputs: inode, offset - page of a program file, frame - its text cache frame
+* Return value: none
+* Function: Takes a page no process maps any more out of the text cache
+*/
+static void release_text_page(uint32_t inode, uint32_t offset, uint32_t frame)
+{
+    text_page_t** link = &text_cache[inode % TEXT_BUCKETS];
+
+    for(; *link != NULL; link = &(*link)->next){
+        text_page_t* text = *link;
+        if(text->inode != inode || text->offset != offset || text->frame != frame) continue;
+
+        *link = text->next;
+        free_frames(frame, 1);
+        kfree(text);
+        text_pages--;
+        return;
+    }
+}
+
+
+/*int32_t copy_on_write(int32_t pid, uint32_t addr)
+* Inputs: pid - process whose page table is current, addr - faulting address
+* Return value: 0 if the page was made writable, -1 if it is read-only or
+* memory ran out
+* Function: Write fault path. Gives a writable page that still maps a
+* filesystem block, or a frame shared with a forked process, its own copy.
+* The last owner of a shared frame takes it over without copying
+*/
+int32_t copy_on_write(int32_t pid, uint32_t addr)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+
+    if(addr < OFF_128MB || addr >= OFF_128MB + OFF_4MB) return -1;
+    addr &= ~(FOUR_KB-1);
+    uint32_t idx = (addr - OFF_128MB) / FOUR_KB;
+    uint32_t pte = table[idx];
+    uint32_t old = pte & ~(FOUR_KB-1);
+
+    if(pte & PAGE_COW){
+        if(frame_owners(old) == 1){
+            table[idx] = old | PAGE_USER;
+            cow_reuses++;
+            invlpg(addr);
+            return 0;
+        }
+    }
+    // Only image pages can be writable, file mappings are read-only
+    else if(!(pte & PAGE_FS) || addr < pcb[pid].image_rw || addr >= pcb[pid].image_end) return -1;
+
+    uint32_t frame = alloc_frames(1, 1, FRAME_LOW);
+    if(frame == 0) return -1;
+
+    // The old page is still mapped read-only at addr
+    memcpy((void*)frame, (void*)addr, FOUR_KB);
+    table[idx] = frame | PAGE_USER;
+    if(pte & PAGE_COW) free_frames(old, 1);
+    else pcb[pid].user_pages++;
+    cow_copies++;
+    invlpg(addr);
+    return 0;
+}
+
+
+/*int32_t fork_user_pages(int32_t parent, int32_t child)
+* Inputs: parent - process whose page table is current on this CPU
+*         child - new process with an empty page table
+* Return value: 0 for success, -1 if a frame has too many owners
+* Function: Gives the child the parent's pages. Private pages become
+* read-only in both, to be copied on the first write (see copy_on_write)
+*/
+int32_t fork_user_pages(int32_t parent, int32_t child)
+{
+    uint32_t* from = (uint32_t*)pcb[parent].page_table;
+    uint32_t* to = (uint32_t*)pcb[child].page_table;
+    int32_t ret = 0;
+    uint32_t cr3;
+    int i;
+
+    // Only a loaded directory can have the parent's entries cached
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    int current = (cr3 == pcb[parent].page_dir);
+
+    for(i=0; i < PAGE_SIZE; i++){
+        uint32_t pte = from[i];
+        if(!(pte & 0x1)) continue;
+
+        // Filesystem blocks are only borrowed, text cache pages just gain
+        // an owner
+        if(!(pte & PAGE_FS)){
+            if(share_frame(pte & ~(FOUR_KB-1)) == -1){
+                ret = -1;
+                break;
+            }
+            if(!(pte & PAGE_TEXT)) pcb[child].user_pages++;
+        }
+
+        // Writable pages are copied on the next write, read-only ones
+        // (like file mappings) stay shared
+        if(pte & (PAGE_RW | PAGE_COW)){
+            uint32_t old = pte;
+            pte = (pte & ~PAGE_RW) | PAGE_COW;
+            from[i] = pte;
+
+            // Drop a cached writable translation of the page
+            if(current && (old & PAGE_RW)) invlpg(OFF_128MB + i * FOUR_KB);
+        }
+        to[i] = pte;
+    }
+
+    // The video memory mapping goes along too
+    ((uint32_t*)pcb[child].page_dir)[VIDM_PDE] = ((uint32_t*)pcb[parent].page_dir)[VIDM_PDE];
+
+    // Other CPUs loaded another directory since they last ran the parent
     return ret;
 }
 
+
+/*void unmap_file_pages(int32_t pid, uint32_t base, uint32_t count)
+* Inputs: pid - process whose page table is current
+*         base - first page of a file mapping, count - pages mapped so far
+* Return value: none
+* Function: Undoes a file mapping that could not be finished. Filesystem
+* blocks are only borrowed, private copies are freed
+*/
+static void unmap_file_pages(int32_t pid, uint32_t base, uint32_t count)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+    uint32_t i;
+
+    for(i=0; i < count; i++){
+        uint32_t addr = base + i * FOUR_KB;
+        uint32_t idx = (addr - OFF_128MB) / FOUR_KB;
+        if(!(table[idx] & 0x1)) continue;
+        if(!(table[idx] & PAGE_FS)){
+            free_frames(table[idx] & ~(FOUR_KB-1), 1);
+            pcb[pid].user_pages--;
+        }
+        table[idx] = 0;
+        invlpg(addr);
+    }
+}
+
+
+/*int32_t map_file(int32_t pid, uint32_t inode_num, uint32_t len)
+* Inputs: pid - process whose page table is current
+*         inode_num - file to map, len - bytes wanted from its start
+* Return value: user address of the mapping, MMAP_FAILED if it does not fit
+* or memory ran out (nothing is left mapped then)
+* Function: mmap system call. Maps a file read-only below the previous
+* mapping, up to len bytes or its whole length if shorter. Pages filled
+* by one page aligned block map the block itself, the rest (the partial
+* last page of the file, or all of it if blocks are not aligned) get a
+* private copy
+*/
+int32_t map_file(int32_t pid, uint32_t inode_num, uint32_t len)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+    uint32_t length = inodes[inode_num].length;
+    uint32_t i;
+
+    if(len > length) len = length;
+    if(len == 0) return MMAP_FAILED;
+
+    // Stay clear of the image and the heap
+    uint32_t pages = (len + FOUR_KB - 1) / FOUR_KB;
+    uint32_t heap_top = (pcb[pid].brk + FOUR_KB - 1) & ~(FOUR_KB-1);
+    if(pages > (pcb[pid].mmap_base - heap_top) / FOUR_KB) return MMAP_FAILED;
+
+    uint32_t base = pcb[pid].mmap_base - pages * FOUR_KB;
+
+    for(i=0; i < pages; i++){
+        uint32_t addr = base + i * FOUR_KB;
+        uint32_t idx = (addr - OFF_128MB) / FOUR_KB;
+        uint32_t offset = i * FOUR_KB;
+        uint32_t block = (uint32_t)&data_blocks[inodes[inode_num].inode_data[offset / BLOCK_SIZE]];
+
+        if(offset + FOUR_KB <= length && !(block & (FOUR_KB-1))){
+            table[idx] = block | PAGE_USER_RO | PAGE_FS;
+            mmap_direct++;
+            continue;
+        }
+
+        if(map_user_pages(pid, addr, 1) == -1){
+            unmap_file_pages(pid, base, i);
+            return MMAP_FAILED;
+        }
+        read_data(inode_num, offset, (uint8_t*)addr, FOUR_KB);
+        table[idx] &= ~PAGE_RW;
+        invlpg(addr);
+        mmap_copied++;
+    }
+
+    pcb[pid].mmap_base = base;
+    return base;
+}
+
+
+/*int32_t set_brk(int32_t pid, uint32_t addr)
+* Inputs: pid - process whose page table is current, addr - new end of
+* the heap
+* Return value: the new break, -1 if it would leave the heap
+* Function: brk system call. The heap runs from the end of the image to
+* the lowest file mapping. Pages it grows over are faulted in zeroed on
+* first touch (see demand_page), pages it shrinks off are freed right away
+*/
+int32_t set_brk(int32_t pid, uint32_t addr)
+{
+    uint32_t* table = (uint32_t*)pcb[pid].page_table;
+
+    if(addr < pcb[pid].image_end || addr > pcb[pid].mmap_base) return -1;
+
+    // Whole pages above the new break, never the image's own
+    uint32_t from = (addr + FOUR_KB - 1) & ~(FOUR_KB-1);
+    uint32_t to = (pcb[pid].brk + FOUR_KB - 1) & ~(FOUR_KB-1);
+    pcb[pid].brk = addr;
+
+    for(; from < to; from += FOUR_KB){
+        uint32_t idx = (from - OFF_128MB) / FOUR_KB;
+        if(!(table[idx] & 0x1)) continue;
+
+        // Heap pages are private (or shared copy-on-write after a fork)
+        free_frames(table[idx] & ~(FOUR_KB-1), 1);
+        pcb[pid].user_pages--;
+        table[idx] = 0;
+        invlpg(from);
+    }
+    return addr;
+}
+
+
+/*int32_t load_prog(int32_t pid, uint32_t inode_num)
+* Inputs: pid, inode_num
+* Return value: length of the image, -1 if it does not fit
+* Function: Sets up the program image (including the part of its segments
+* past the end of the file) and the stack to be faulted in page by page
+* on first touch (see demand_page). Nothing is read here */
+int32_t load_prog(int32_t pid, uint32_t inode_num){
+    uint32_t length = inodes[inode_num].length;
+    uint32_t image_end = (uint32_t)program_start + length;
+    uint32_t image_rw = USER_STACK_BOTTOM;
+    uint8_t ehdr[ELF_EHDR_SIZE];
+    uint8_t phdr[ELF_PHDR_SIZE];
+    uint32_t i;
+
+    // The file is loaded as is, so only the segments' memory size can
+    // reach further (bss). Pages from the first writable segment on may
+    // be written, the ones below it stay shared with the filesystem
+    if(read_data(inode_num, 0, ehdr, ELF_EHDR_SIZE) != ELF_EHDR_SIZE){
+        image_rw = (uint32_t)program_start;
+    }
+    else{
+        uint32_t phoff = *(uint32_t*)&ehdr[ELF_PHOFF];
+        uint32_t phnum = *(uint16_t*)&ehdr[ELF_PHNUM];
+        for(i=0; i < phnum; i++){
+            if(read_data(inode_num, phoff + i * ELF_PHDR_SIZE, phdr, ELF_PHDR_SIZE) != ELF_PHDR_SIZE) break;
+            uint32_t vaddr = *(uint32_t*)&phdr[ELF_P_VADDR];
+            uint32_t end = vaddr + *(uint32_t*)&phdr[ELF_P_MEMSZ];
+            if(*(uint32_t*)phdr != PT_LOAD || vaddr < OFF_128MB) continue;
+            if(end > image_end) image_end = end;
+            if((*(uint32_t*)&phdr[ELF_P_FLAGS] & ELF_PF_W) && vaddr < image_rw) image_rw = vaddr & ~(FOUR_KB-1);
+        }
+    }
+
+    // A guard page between the stack and the file mappings
+    uint32_t mmap_base = USER_STACK_BOTTOM - FOUR_KB;
+    if(image_end > mmap_base) return -1;
+
+    pcb[pid].image_inode = inode_num;
+    pcb[pid].image_len = length;
+    pcb[pid].image_end = image_end;
+    pcb[pid].image_rw = image_rw;
+    pcb[pid].mmap_base = mmap_base;
+
+    // The heap starts on a fresh page if the image's last one is read-only
+    pcb[pid].brk = image_end;
+    if(((image_end - 1) & ~(FOUR_KB-1)) < image_rw) pcb[pid].brk = (image_end + FOUR_KB - 1) & ~(FOUR_KB-1);
+    return length;
+}
+
 /*void vidmap_helper(uint8 * input)
 * Inputs: input
 * Return value: None
@@ -139,33 +722,50 @@ int32_t load_prog(uint32_t inode_num){
 */
 void vidmap_helper(uint8_t* input){
     uint32_t input2 = (uint32_t)input >> 22;
-    page_directory[input2] = (uint32_t)page_table_2|0x7;
-    uint32_t vmem = VIDEO;
-    page_table_2[0] = vmem | 0x7;
+    int32_t pid = exec_process;
 
-    asm volatile(
-                 "mov %%cr3, %%eax;"
-                 "mov %%eax, %%cr3;"
-                 :                      
-                 :                     
-                 :"%eax"                
-                 );
+    // Only in the caller's directory, through its terminal's table
+    ((uint32_t*)pcb[pid].page_dir)[input2] = (uint32_t)vidmap_table[pcb[pid].terminal]|0x7;
+
+    // Only the vidmap page changed
+    invlpg((uint32_t)input);
 }
 
-/*void remap_vidmem(int process)
-* Inputs: input
+/*void remap_vidmem()
+* Inputs: None
 * Return value: None
-* Function: remaps video memory */
-void remap_vidmem(int process)
+* Function: remaps video memory. Points the active terminal's vidmap page
+* at the screen and the others at their backing pages. Call whenever the
+* active terminal changes. A process alone on another CPU never reloads
+* cr3, so every CPU running one is told to drop its entry too */
+void remap_vidmem()
 {
-    page_table_2[0] = (FOUR_KB*(VM_ADDR+process+1))|0x7;
-    asm volatile(
-                 "mov %%cr3, %%eax;"
-                 "mov %%eax, %%cr3;"
-                 :                      
-                 :                     
-                 :"%eax"                
-                 );
+    int i;
+    for(i=0; i < NUM_TERMINAL; i++){
+        if(i == active_terminal) vidmap_table[i][0] = VIDEO|0x7;
+        else vidmap_table[i][0] = (FOUR_KB*(VM_ADDR+i+1))|0x7;
+    }
+    invlpg(VIDM_ADDR);
+
+    // The IPI is taken before the next user instruction there, and the
+    // kernel never writes through vidmap, so no need to wait for it
+    for(i=0; i < num_cpus; i++){
+        if(i != this_cpu()->id && cpus[i].process != -1) send_ipi(i, TLB_IDT);
+    }
+}
+
+
+/*void tlb_ipi_handler()
+* Inputs: None
+* Return value: None
+* Function: Drops this CPU's vidmap translation after another CPU
+* switched terminals (see remap_vidmem). Runs without the kernel lock,
+* which the sender may hold
+*/
+void tlb_ipi_handler()
+{
+    lapic_eoi();
+    asm volatile("invlpg (%0)" : : "r"(VIDM_ADDR) : "memory");
 }
 
 /*void debug_remap()
@@ -176,13 +776,7 @@ void remap_vidmem(int process)
 void debug_remap()
 {
     page_table[VM_ADDR+1] = (FOUR_KB*(VM_ADDR))|0x7;
-    asm volatile(
-                 "mov %%cr3, %%eax;"
-                 "mov %%eax, %%cr3;"
-                 :                      
-                 :                     
-                 :"%eax"                
-                 );
+    invlpg(terminal_start);
 }
 
 
@@ -193,7 +787,8 @@ void debug_remap()
 */
 void end_vidmap()
 {
-    page_table_2[0] = 0x2;
+    ((uint32_t*)pcb[exec_process].page_dir)[VIDM_PDE] = 0x2;
+    invlpg(VIDM_ADDR);
 }
 
 
@@ -202,8 +797,136 @@ void end_vidmap()
 * Return value: None
 * Function: bool for if vidmap is being used
 */
-inline int vidmap_present()
+int vidmap_present()
+{
+    return ((uint32_t*)pcb[exec_process].page_dir)[VIDM_PDE] & 0x1;
+}
+
+
+/*uint32_t map_kstack(int32_t pid)
+* Inputs: pid - process being created
+* Return value: bottom of the pid's kernel stack, 0 if out of memory
+* Function: Backs the pid's kernel stack slot with fresh frames, which need
+* not be contiguous or in low memory. The page below stays unmapped.
+* Entries are not global, so other CPUs drop any they cached for the slot's
+* last owner when they switch away from it
+*/
+uint32_t map_kstack(int32_t pid)
 {
-    return page_table_2[0] & 0x1;
+    uint32_t base = KSTACK_BASE + pid * KSTACK_SLOT + FOUR_KB;
+    uint32_t* pte = &kstack_tables[(base - KSTACK_BASE) / FOUR_KB];
+    int i;
+
+    for(i=0; i < KSTACK_PAGES; i++){
+        uint32_t frame = alloc_frames(1, 1, 0);
+        if(frame == 0){
+            while(i-- > 0) free_frames(pte[i] & ~(FOUR_KB-1), 1);
+            for(i=0; i < KSTACK_PAGES; i++) pte[i] = 0;
+            return 0;
+        }
+        pte[i] = frame | 0x3;
+        invlpg(base + i * FOUR_KB);
+    }
+    return base;
+}
+
+
+/*void unmap_kstack(int32_t pid)
+* Inputs: pid - ended process, not running on this stack (a process ending
+* itself is left to reap_process)
+* Return value: none
+* Function: Frees a kernel stack and unmaps it
+*/
+void unmap_kstack(int32_t pid)
+{
+    uint32_t base = KSTACK_BASE + pid * KSTACK_SLOT + FOUR_KB;
+    uint32_t* pte = &kstack_tables[(base - KSTACK_BASE) / FOUR_KB];
+    int i;
+
+    for(i=0; i < KSTACK_PAGES; i++){
+        if(!(pte[i] & 0x1)) continue;
+        free_frames(pte[i] & ~(FOUR_KB-1), 1);
+        pte[i] = 0;
+        invlpg(base + i * FOUR_KB);
+    }
+}
+
+
+/*int32_t kstack_guard_pid(uint32_t addr)
+* Inputs: addr - faulting address
+* Return value: pid whose kernel stack overflowed, -1 if addr is not in a
+* guard page
+* Function: Tells a kernel stack overflow from other faults
+*/
+int32_t kstack_guard_pid(uint32_t addr)
+{
+    if(addr < KSTACK_BASE || addr >= KSTACK_BASE + num_pids * KSTACK_SLOT) return -1;
+    if((addr - KSTACK_BASE) % KSTACK_SLOT >= FOUR_KB) return -1;
+    return (addr - KSTACK_BASE) / KSTACK_SLOT;
+}
+
+
+/*void print_mem_stats()
+* Inputs: None
+* Return value: None
+* Function: Prints free memory and what each process holds
+*/
+void print_mem_stats()
+{
+    int32_t pid;
+    uint32_t kb_per_frame = FOUR_KB / 1024;
+
+    printf("memory %u KB free of %u KB, %d process slots\n", frames_free() * kb_per_frame, frames_total * kb_per_frame, num_pids);
+    printf("pages faulted in %u, mapped from fs %u, copied on write %u, reused %u\n", demand_faults, fs_mapped_pages, cow_copies, cow_reuses);
+    printf("text cache %u pages, %u shared maps\n", text_pages, text_hits);
+    printf("mmap pages %u from fs, %u copied\n", mmap_direct, mmap_copied);
+    printf("fork %u cycles, execute %u cycles\n", fork_cycles, exec_cycles);
+    for(pid=0; pid < num_pids; pid++){
+        if(pcb[pid].flags == PCB_ABSENT) continue;
+        printf("pid %d: user %u KB, kernel %u KB\n", pid, pcb[pid].user_pages * kb_per_frame,
+               (KSTACK_FRAMES + 2) * kb_per_frame);
+    }
+}
+
+
+/*void map_kernel_page(uint32_t addr)
+* Inputs: addr - physical address below 4MB
+* Return value: None
+* Function: Identity maps a low memory page for the kernel
+*/
+void map_kernel_page(uint32_t addr)
+{
+    page_table[addr / FOUR_KB] = (addr & ~(FOUR_KB-1)) | 0x3;
+    invlpg(addr);
+}
+
+
+/*void unmap_kernel_page(uint32_t addr)
+* Inputs: addr - address mapped by map_kernel_page
+* Return value: None
+* Function: Removes a low memory mapping again
+*/
+void unmap_kernel_page(uint32_t addr)
+{
+    page_table[addr / FOUR_KB] = (addr & ~(FOUR_KB-1)) | 0x6;
+    invlpg(addr);
+}
+
+
+/*void map_kernel_mmio(uint32_t addr)
+* Inputs: addr - physical address of device registers
+* Return value: None
+* Function: Identity maps the 4MB region holding addr uncached, in the
+* kernel's directory and every process's
+*/
+void map_kernel_mmio(uint32_t addr)
+{
+    uint32_t pde = (addr & ~(OFF_4MB-1)) | PAGE_GLOBAL | 0x80 | PAGE_PCD | PAGE_PWT | 0x3;
+    int i;
+    page_directory[addr >> 22] = pde;
+    for(i=0; i < num_pids; i++){
+        if(pcb[i].flags == PCB_EXISTS) ((uint32_t*)pcb[i].page_dir)[addr >> 22] = pde;
+    }
+    invlpg(addr);
 }
 
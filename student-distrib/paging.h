@@ -2,33 +2,131 @@
 #define _PAGING_H
 
 #include "types.h"
+#include "x86_desc.h"
 
 #define PAGE_SIZE   1024
 #define VM_ADDR     184
 #define OFF_128     0x48000
 #define FOUR_KB     4096
 #define OFF_8KB     0x002000
+#define OFF_1MB     0x100000
 #define OFF_8MB     0x800000
 #define OFF_4MB     0x400000
 #define OFF_128MB   0x8000000
+#define VIDM_ADDR   0x8800000
+#define VIDM_PDE    (VIDM_ADDR >> 22)
+
+// Program region: one page table of 4KB pages at 128MB per process, with
+// the image at program_start and the stack at the top
+#define USER_PDE            32
+#define USER_STACK_PAGES    4
+#define USER_STACK_BOTTOM   (OFF_128MB + OFF_4MB - USER_STACK_PAGES * FOUR_KB)
+
+// Kernel stacks: a slot per pid in a region of their own, KSTACK_PAGES
+// mapped above an unmapped guard page, so running off the bottom of a
+// stack faults instead of overwriting whatever lies below
+#define KSTACK_BASE         0xC0000000
+#define KSTACK_PDE          (KSTACK_BASE >> 22)
+#define KSTACK_REGION       0x10000000
+#define KSTACK_PAGES        4
+#define KSTACK_SLOT         ((KSTACK_PAGES + 1) * FOUR_KB)
+#define KSTACK_MAX_SLOTS    (KSTACK_REGION / KSTACK_SLOT)
+
+// ELF header fields used to size the image
+#define ELF_EHDR_SIZE   52
+#define ELF_PHDR_SIZE   32
+#define ELF_PHOFF       28
+#define ELF_PHNUM       44
+#define ELF_P_VADDR     8
+#define ELF_P_MEMSZ     20
+#define ELF_P_FLAGS     24
+#define PT_LOAD         1
+#define ELF_PF_W        0x2
+
+#define PAGE_USER   0x7         // present, read-write, user
+#define PAGE_USER_RO 0x5        // present, read-only, user
+#define PAGE_RW     0x2
+#define PAGE_FS     0x200       // available bit: frame is a filesystem block
+#define PAGE_COW    0x400       // available bit: frame shared since fork
+#define PAGE_TEXT   0x800       // available bit: frame from the text cache
+#define PAGE_GLOBAL 0x100       // entry survives cr3 reloads
+#define PAGE_PCD    0x10        // cache disable, for device registers
+#define PAGE_PWT    0x08
+#define CR4_PGE     0x80
+#define CR0_WP      0x10000     // read-only pages also bind the kernel
+
+// Read-only program page that could not map its filesystem block, kept
+// while any process maps it
+#define TEXT_BUCKETS    16
+
+typedef struct text_page {
+    uint32_t inode;
+    uint32_t offset;            // file offset of the page
+    uint32_t frame;             // the cache holds one of its owners
+    struct text_page* next;
+} text_page_t;
 
 // Start address of user program
-uint8_t* program_start;
+extern uint8_t* program_start;
 
 // Start address of terminal video instances
-uint32_t terminal_start;
+extern uint32_t terminal_start;
 
 // Start address of video memory
-uint32_t video_start;
+extern uint32_t video_start;
+
+// Kernel page directory, each process's starts as a copy of it
+extern uint32_t page_directory[PAGE_SIZE];
+
+// TLB maintenance counters (full cr3 reloads, single page invalidations,
+// and page table updates skipped because the mapping was unchanged)
+extern uint32_t tlb_flushes;
+extern uint32_t tlb_invlpgs;
+extern uint32_t tlb_skips;
+
+// Program pages filled on first touch, mapped straight from the
+// filesystem image, copied when first written, and taken over on a
+// write by their last owner
+extern uint32_t demand_faults;
+extern uint32_t fs_mapped_pages;
+extern uint32_t cow_copies;
+extern uint32_t cow_reuses;
+
+// File pages mapped by mmap straight from the filesystem, and copied
+extern uint32_t mmap_direct;
+extern uint32_t mmap_copied;
+
+// Text cache pages loaded and mapped again by another process
+extern uint32_t text_pages;
+extern uint32_t text_hits;
 
 void create_pages();
 void init_paging();
 
+uint32_t create_page_dir(uint32_t table);
 void create_process_page(uint32_t pid);
-int32_t load_prog(uint32_t inode_num);
+void use_kernel_page_dir();
+int32_t load_prog(int32_t pid, uint32_t inode_num);
+int32_t map_user_pages(int32_t pid, uint32_t addr, uint32_t count);
+void free_user_pages(int32_t pid);
+int32_t user_page_valid(int32_t pid, uint32_t addr);
+int32_t user_range_ok(int32_t pid, uint32_t addr, uint32_t len);
+int32_t demand_page(int32_t pid, uint32_t addr);
+int32_t copy_on_write(int32_t pid, uint32_t addr);
+int32_t fork_user_pages(int32_t parent, int32_t child);
+int32_t map_file(int32_t pid, uint32_t inode_num, uint32_t len);
+int32_t set_brk(int32_t pid, uint32_t addr);
+uint32_t map_kstack(int32_t pid);
+void unmap_kstack(int32_t pid);
+int32_t kstack_guard_pid(uint32_t addr);
+void print_mem_stats();
 void vidmap_helper(uint8_t* input);
-void remap_vidmem(int process);
+void remap_vidmem();
+void tlb_ipi_handler();
 void debug_remap();
 void end_vidmap();
+void map_kernel_page(uint32_t addr);
+void unmap_kernel_page(uint32_t addr);
+void map_kernel_mmio(uint32_t addr);
 
 #endif /* _PAGING_H */
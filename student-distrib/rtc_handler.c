@@ -1,6 +1,8 @@
 #include "rtc_handler.h"
 #include "i8259.h"
 #include "scheduler.h"
+#include "clock.h"
+#include "slab.h"
 
 /*
 The 2 IO ports used for the RTC and CMOS are 0x70 and 0x71. 
@@ -11,13 +13,40 @@ They are called RTC Status Register A, B, and C.
 They are at offset 0xA, 0xB, and 0xC in the CMOS RAM
 */
 
-// RTC client block
-rtcc_t rtc_block[RTC_SIZE];
+// Clients ordered by deadline (binary min-heap), so an interrupt only
+// touches the clients that are due. Grown with kmalloc as clients open
+static rtcc_t** rtc_heap = NULL;
+static int32_t rtc_heap_size = 0;
+static int32_t rtc_heap_cap = 0;
+
+// Time since boot in HZ_1024 periods, advancing only while IRQ8 is unmasked
+static volatile uint32_t rtc_ticks = 0;
+
+// Hardware period in HZ_1024 periods (the fastest client's), 0 while masked
+static uint32_t rtc_period = 0;
+
+// Open clients at each period, indexed by log2 of the period
+static uint32_t rtc_rate_count[RTC_RATES];
+
+// Interrupts taken, and the count and time at the last stats dump
+static uint32_t rtc_irqs = 0;
+static uint32_t stats_irqs = 0;
+static uint32_t stats_ms = 0;
+
+static rtcc_t* rtc_client(int32_t fd);
+static int32_t rate_index(uint32_t rate);
+static void rtc_set_rate(uint32_t rate, int32_t delta);
+static int32_t heap_reserve(void);
+static void heap_insert(rtcc_t* c);
+static void heap_remove(rtcc_t* c);
+static void heap_sift_up(int32_t idx);
+static void heap_sift_down(int32_t idx);
 
 /* void init_rtc(void);
  * Inputs: void
  * Return Value: none
- * Function: Initializes the RTC registers and enables the RTC IRQ */
+ * Function: Initializes the RTC registers. IRQ8 stays masked until the
+ * first client opens the RTC. Call after init_pcb */
 void init_rtc(void)
 {
     // Initialize RTC registers
@@ -27,23 +56,12 @@ void init_rtc(void)
     outb(REG_NMI | REGB, RTC_PORT);		// set the index again (a read will reset the index to register D)
     outb(prev | 0x40, CMOS_PORT);	    // write the previous value ORed with 0x40. This turns on bit 6 of register B
 
-    // Initialize process frequencies and counts
+    // Clients and the heap are allocated as they open
     int i;
-    for(i=0; i < RTC_SIZE; i++){
-        rtc_block[i].client = -1;
-        rtc_block[i].rate = -1;
-        rtc_block[i].count = 0;
-        rtc_block[i].flags = RTC_WAIT;
+    for(i=0; i < RTC_RATES; i++){
+        rtc_rate_count[i] = 0;
     }
-
-    // Run RTC at highest frequency
-    outb(REG_NMI | REGA, RTC_PORT);		        // set index to register A, disable NMI
-    prev = inb(CMOS_PORT);	                    // get initial value of register A
-    outb(REG_NMI | REGA, RTC_PORT);		        // reset index to A
-    outb((prev & 0xF0) | RATE_MAX, CMOS_PORT);  // write only our rate to A. Note, rate is the bottom 4 bits.
-
-    //Enable RTC interrupts IRQ8 on slave and IRQ2 on master
-    enable_irq(IRQ8);
+    disable_irq(IRQ8);
 }
 
 
@@ -60,32 +78,39 @@ void rtc_handler(void)
     outb(REGC, RTC_PORT);	
     inb(CMOS_PORT);		
 
-    // Update RTC frequency count for each scheduled process
-    int i;
-    for(i=0; i < RTC_SIZE; i++){
-        if(rtc_block[i].client != -1){
-            rtc_block[i].count++;
-
-            // If frequency is met, signal the rtc process flag
-            if(rtc_block[i].count >= rtc_block[i].rate){
-                rtc_block[i].flags = RTC_TICK;
-                rtc_block[i].count = 0;
-            }
-        }
-    } 
+    rtc_irqs++;
+    rtc_ticks += rtc_period;
+
+    // Signal and wake every client whose virtual tick is due
+    while(rtc_heap_size > 0 && (int32_t)(rtc_ticks - rtc_heap[0]->deadline) >= 0){
+        rtcc_t* c = rtc_heap[0];
+        c->flags = RTC_TICK;
+        c->deadline += c->rate;
+        heap_sift_down(0);
+        sched_wake(&c->queue);
+    }
 
     return;
 }
 
 
-/* void rtc_handler(void);
- * Inputs: void
- * Return Value: none
- * Function: RTC handler, ticks then sends EOI */
+/* int32_t rtc_read(int32_t fd, void* buf, int32_t nbytes);
+ * Inputs: fd, buf, nbytes
+ * Return Value: 0 for success, -1 for failure
+ * Function: Sleeps until the next virtual tick of the fd's client */
 int32_t rtc_read(int32_t fd, void* buf, int32_t nbytes){
-    // Wait for RTC_tick, then reset status
-    while(rtc_block[exec_terminal].flags == RTC_WAIT){}
-    rtc_block[exec_terminal].flags = RTC_WAIT;
+    rtcc_t* c = rtc_client(fd);
+    if(c == NULL) return -1;
+
+    uint32_t flags;
+
+    // Sleep until RTC_tick, then reset status
+    cli_and_save(flags);
+    while(c->flags == RTC_WAIT){
+        sched_block(&c->queue);
+    }
+    c->flags = RTC_WAIT;
+    restore_flags(flags);
     return 0;
 }
 
@@ -111,24 +136,55 @@ int32_t rtc_write(int32_t fd, const void* buf, int32_t nbytes){
     else if(freq >= HZ_2) rate = RTC_R512;
     else return -1;
 
-    // Set new rate for writing process
-    rtc_block[exec_terminal].rate = rate;
+    rtcc_t* c = rtc_client(fd);
+    if(c == NULL) return -1;
+
+    // Set new rate for this client, its next tick is a full period away
+    uint32_t flags;
+    cli_and_save(flags);
+    if(c->heap_idx == -1 && heap_reserve() == -1){
+        restore_flags(flags);
+        return -1;
+    }
+    if(c->rate != 0) rtc_set_rate(c->rate, -1);
+    rtc_set_rate(rate, 1);
+    c->rate = rate;
+    c->deadline = rtc_ticks + rate;
+    if(c->heap_idx == -1) heap_insert(c);
+    else {
+        heap_sift_up(c->heap_idx);
+        heap_sift_down(c->heap_idx);
+    }
+    restore_flags(flags);
     return sizeof(freq);
 }
 
 
-/* uint32_t rtc_open(const uint8_t* filename);
- * Inputs: filename
+/* uint32_t rtc_open(const uint8_t* filename, int32_t fd);
+ * Inputs: filename, fd
  * Return Value: 0 for success, -1 for failure
- * Function: Opens an RTC instance */
-int32_t rtc_open(const uint8_t* filename){
+ * Function: Opens an RTC instance with its own virtual rate */
+int32_t rtc_open(const uint8_t* filename, int32_t fd){
+    if(exec_process == -1 || fd < 0 || fd >= FDT_SIZE) return -1;
+
     // Create client
-    rtc_block[exec_terminal].client = tmnl_block[exec_terminal].active_process;
+    rtcc_t* c = kmalloc(sizeof(rtcc_t));
+    if(c == NULL) return -1;
+    c->client = exec_process;
+    c->rate = 0;
+    c->heap_idx = -1;
+    c->flags = RTC_WAIT;
+    pq_init(&c->queue);
+    pcb[exec_process].fd_table[fd].data = c;
 
     // Initialize opening process frequency to 2Hz
     uint32_t init_freq = HZ_2;
-    int ret = rtc_write(0, &init_freq, sizeof(init_freq));
-    if(ret == -1) return -1;
+    int ret = rtc_write(fd, &init_freq, sizeof(init_freq));
+    if(ret == -1){
+        pcb[exec_process].fd_table[fd].data = NULL;
+        kfree(c);
+        return -1;
+    }
     return 0;
 }
 
@@ -138,11 +194,240 @@ int32_t rtc_open(const uint8_t* filename){
  * Return Value: 0 for success, -1 for failure
  * Function: Closes an RTC instance */
 int32_t rtc_close(int32_t fd){
-    // Close process rtc
-    rtc_block[exec_terminal].client = -1;
-    rtc_block[exec_terminal].rate = -1;
-    rtc_block[exec_terminal].count = 0;
-    rtc_block[exec_terminal].flags = RTC_WAIT;
+    rtcc_t* c = rtc_client(fd);
+    if(c == NULL) return -1;
+
+    pcb[exec_process].fd_table[fd].data = NULL;
+    rtc_release(c);
+    return 0;
+}
+
+
+/* void* rtc_dup(void* data, int32_t pid);
+ * Inputs: data - RTC client of an open descriptor, pid - process getting
+ * the copy
+ * Return Value: the new client, NULL if out of memory
+ * Function: fork of an RTC descriptor. The copy ticks at the same rate and
+ * on the same deadlines as the original */
+void* rtc_dup(void* data, int32_t pid){
+    rtcc_t* from = data;
+    rtcc_t* c = kmalloc(sizeof(rtcc_t));
+    if(c == NULL) return NULL;
+
+    c->client = pid;
+    c->rate = from->rate;
+    c->deadline = from->deadline;
+    c->heap_idx = -1;
+    c->flags = from->flags;
+    pq_init(&c->queue);
+
+    uint32_t flags;
+    cli_and_save(flags);
+    if(c->rate != 0){
+        if(heap_reserve() == -1){
+            restore_flags(flags);
+            kfree(c);
+            return NULL;
+        }
+        rtc_set_rate(c->rate, 1);
+        heap_insert(c);
+    }
+    restore_flags(flags);
+    return c;
+}
+
+
+/* void rtc_release(void* data);
+ * Inputs: data - RTC client of a descriptor being closed
+ * Return Value: none
+ * Function: Takes the client out of the deadline heap and frees it. Works
+ * for any process's descriptor, not just the running one's */
+void rtc_release(void* data){
+    rtcc_t* c = data;
+
+    uint32_t flags;
+    cli_and_save(flags);
+    if(c->heap_idx != -1) heap_remove(c);
+    if(c->rate != 0) rtc_set_rate(c->rate, -1);
+    kfree(c);
+    restore_flags(flags);
+}
+
+
+/* void print_rtc_stats(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Prints the hardware rate and the interrupts per second since
+ * the last call (or boot) */
+void print_rtc_stats(void){
+    uint32_t now = clock_ms();
+    uint32_t elapsed = now - stats_ms;
+    uint32_t irqs = rtc_irqs - stats_irqs;
+    uint32_t per_sec;
+
+    // Scale without overflowing irqs * 1000
+    if(elapsed >= 1000) per_sec = irqs / (elapsed / 1000);
+    else if(elapsed > 0) per_sec = irqs * 1000 / elapsed;
+    else per_sec = 0;
+
+    printf("rtc %u Hz, %u clients, %u interrupts/s\n", (rtc_period == 0) ? 0 : HZ_1024 / rtc_period, rtc_heap_size, per_sec);
+    stats_ms = now;
+    stats_irqs = rtc_irqs;
+}
+
+
+/* int32_t rate_index(uint32_t rate);
+ * Inputs: rate - client period, a power of two from RTC_R1 to RTC_R512
+ * Return Value: log2 of the period
+ * Function: Indexes rtc_rate_count */
+static int32_t rate_index(uint32_t rate){
+    int32_t i = 0;
+    while((RTC_R1 << i) < rate) i++;
+    return i;
+}
+
+
+/* void rtc_set_rate(uint32_t rate, int32_t delta);
+ * Inputs: rate - client period
+ *         delta - 1 when a client takes the period, -1 when it leaves it
+ * Return Value: none
+ * Function: Runs the hardware at the fastest rate an open client needs,
+ * masking IRQ8 once there are none. Call with interrupts disabled */
+static void rtc_set_rate(uint32_t rate, int32_t delta){
+    rtc_rate_count[rate_index(rate)] += delta;
+
+    int32_t i;
+    for(i=0; i < RTC_RATES; i++){
+        if(rtc_rate_count[i] != 0) break;
+    }
+
+    if(i == RTC_RATES){
+        if(rtc_period != 0) disable_irq(IRQ8);
+        rtc_period = 0;
+        return;
+    }
+    if(rtc_period == (RTC_R1 << i)) return;
+
+    // Periods are powers of two, so every client's is a multiple of this one
+    outb(REG_NMI | REGA, RTC_PORT);		            // set index to register A, disable NMI
+    char prev = inb(CMOS_PORT);	                    // get initial value of register A
+    outb(REG_NMI | REGA, RTC_PORT);		            // reset index to A
+    outb((prev & RATE_MASK) | (RATE_MAX + i), CMOS_PORT);  // rate is the bottom 4 bits
+
+    if(rtc_period == 0){
+        // Drop a flag left from before IRQ8 was masked so interrupts resume
+        outb(REGC, RTC_PORT);
+        inb(CMOS_PORT);
+        enable_irq(IRQ8);
+    }
+    rtc_period = RTC_R1 << i;
+}
+
+
+/* rtcc_t* rtc_client(int32_t fd);
+ * Inputs: fd
+ * Return Value: RTC client of the fd, NULL if it has none
+ * Function: Looks up the client of one of the current process's fds */
+static rtcc_t* rtc_client(int32_t fd){
+    if(exec_process == -1 || fd < 0 || fd >= FDT_SIZE) return NULL;
+
+    fd_t* file = &pcb[exec_process].fd_table[fd];
+    if(file->flags != FD_EXISTS || file->file_operations_table != &rtc_fileops) return NULL;
+    return file->data;
+}
+
+
+/* int32_t heap_reserve(void);
+ * Inputs: none
+ * Return Value: 0 if the heap has room for one more client, -1 if out of
+ * memory
+ * Function: Doubles the deadline heap when it is full. Call with
+ * interrupts off, before heap_insert */
+static int32_t heap_reserve(void){
+    if(rtc_heap_size < rtc_heap_cap) return 0;
+
+    int32_t cap = (rtc_heap_cap == 0) ? RTC_HEAP_MIN : rtc_heap_cap * 2;
+    rtcc_t** heap = kmalloc(cap * sizeof(rtcc_t*));
+    if(heap == NULL) return -1;
+
+    if(rtc_heap != NULL){
+        memcpy(heap, rtc_heap, rtc_heap_size * sizeof(rtcc_t*));
+        kfree(rtc_heap);
+    }
+    rtc_heap = heap;
+    rtc_heap_cap = cap;
     return 0;
 }
 
+
+/* void heap_insert(rtcc_t* c);
+ * Inputs: c - client with its deadline set
+ * Return Value: none
+ * Function: Adds a client to the deadline heap in O(log n), after
+ * heap_reserve made room for it */
+static void heap_insert(rtcc_t* c){
+    c->heap_idx = rtc_heap_size;
+    rtc_heap[rtc_heap_size++] = c;
+    heap_sift_up(c->heap_idx);
+}
+
+
+/* void heap_remove(rtcc_t* c);
+ * Inputs: c - client in the heap
+ * Return Value: none
+ * Function: Takes a client out of the deadline heap in O(log n) */
+static void heap_remove(rtcc_t* c){
+    int32_t idx = c->heap_idx;
+    rtcc_t* last = rtc_heap[--rtc_heap_size];
+    c->heap_idx = -1;
+    if(last == c) return;
+
+    // Move the last client into the hole and restore the order around it
+    rtc_heap[idx] = last;
+    last->heap_idx = idx;
+    heap_sift_up(idx);
+    heap_sift_down(last->heap_idx);
+}
+
+
+/* void heap_sift_up(int32_t idx);
+ * Inputs: idx - heap position
+ * Return Value: none
+ * Function: Moves a client up while its deadline is earlier than its parent's */
+static void heap_sift_up(int32_t idx){
+    while(idx > 0){
+        int32_t parent = (idx - 1) / 2;
+        if((int32_t)(rtc_heap[idx]->deadline - rtc_heap[parent]->deadline) >= 0) break;
+
+        rtcc_t* tmp = rtc_heap[parent];
+        rtc_heap[parent] = rtc_heap[idx];
+        rtc_heap[idx] = tmp;
+        rtc_heap[parent]->heap_idx = parent;
+        rtc_heap[idx]->heap_idx = idx;
+        idx = parent;
+    }
+}
+
+
+/* void heap_sift_down(int32_t idx);
+ * Inputs: idx - heap position
+ * Return Value: none
+ * Function: Moves a client down while a child has an earlier deadline */
+static void heap_sift_down(int32_t idx){
+    while(1){
+        int32_t left = 2 * idx + 1;
+        int32_t right = left + 1;
+        int32_t min = idx;
+
+        if(left < rtc_heap_size && (int32_t)(rtc_heap[left]->deadline - rtc_heap[min]->deadline) < 0) min = left;
+        if(right < rtc_heap_size && (int32_t)(rtc_heap[right]->deadline - rtc_heap[min]->deadline) < 0) min = right;
+        if(min == idx) return;
+
+        rtcc_t* tmp = rtc_heap[min];
+        rtc_heap[min] = rtc_heap[idx];
+        rtc_heap[idx] = tmp;
+        rtc_heap[min]->heap_idx = min;
+        rtc_heap[idx]->heap_idx = idx;
+        idx = min;
+    }
+}
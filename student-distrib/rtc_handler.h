@@ -6,9 +6,11 @@
 #include "types.h"
 #include "PCB.h"
 #include "terminal.h"
+#include "scheduler.h"
 
 
-#define RTC_SIZE   NUM_TERMINAL
+// Deadline heap entries before it first grows
+#define RTC_HEAP_MIN    16
 
 #define RTC_WAIT    1
 #define RTC_TICK    0
@@ -22,7 +24,9 @@
 #define IRQ2        0x02
 #define IRQ8        0x08
 
-#define RATE_MAX    6
+#define RATE_MAX    6           // rate register value for HZ_1024
+#define RATE_MASK   0xF0
+#define RTC_RATES   10          // client periods RTC_R1 to RTC_R512
 
 #define RTC_R1      1  
 #define RTC_R2      2
@@ -49,18 +53,24 @@
 
 void init_rtc(void);
 void rtc_handler(void);
+void print_rtc_stats(void);
 
 int32_t rtc_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t rtc_write(int32_t fd, const void* buf, int32_t nbytes);
-int32_t rtc_open(const uint8_t* filename);
+int32_t rtc_open(const uint8_t* filename, int32_t fd);
 int32_t rtc_close(int32_t fd);
+void* rtc_dup(void* data, int32_t pid);
+void rtc_release(void* data);
 
 
-// RTC client struct
+// RTC client struct, the virtual RTC of one file descriptor, allocated
+// when it is opened and hung off the descriptor's data
 typedef struct rtc_client {
-    int client;
-    volatile int32_t rate;
-    volatile int32_t count;
+    int32_t client;             // owning pid
+    uint32_t rate;              // RTC interrupts per virtual tick
+    uint32_t deadline;          // rtc_ticks value of the next virtual tick
+    int32_t heap_idx;           // position in the deadline heap
+    pq_t queue;                 // owner sleeping in rtc_read
     volatile uint8_t flags;
 } rtcc_t;
 
@@ -5,9 +5,48 @@
 #include "terminal.h"
 #include "syscall.h"
 #include "paging.h"
+#include "as_wrapper.h"
+#include "set_idt.h"
+#include "clock.h"
+#include "timer.h"
 
 int debug_flag = 1;
 
+// PIT tick rate and the matching channel 0 divisor
+static uint32_t tick_hz = TICK_HZ_DEFAULT;
+static uint32_t pit_divisor = PIT_FREQ / TICK_HZ_DEFAULT;
+
+// Processes that can never run again (e.g. a shell that failed to load)
+static pq_t dead_queue;
+
+// Processes blocked in sleep, woken one at a time by their sleep_timer
+static pq_t sleep_queue;
+
+// Set while the PIT is masked (always, once the local APIC timers took over)
+static int tick_stopped = 0;
+
+// Preemption clock: the PIT on the boot CPU, forwarded to the others by IPI,
+// or each CPU's own local APIC timer (lapic_count timer counts per tick)
+static int lapic_clock = 0;
+static uint32_t lapic_per_ms = 0;
+static uint32_t lapic_count = 0;
+
+// Scheduler statistics (per-CPU counters live in cpu_t)
+static uint32_t pit_ticks = 0;
+static uint32_t tick_cycles = 0;     // moving average of cycles spent per tick
+static uint32_t switch_cycles = 0;   // moving average of cycles per context switch
+static uint64_t switch_start;
+
+static void sched_boost(cpu_t* cpu);
+static int32_t slice_ticks(int32_t pid);
+static int charge_tick(int32_t pid);
+static void spawn_shell(int tmnl_id);
+static void sched_tick(void);
+static int32_t sched_steal(cpu_t* thief);
+static int32_t queued(cpu_t* cpu);
+static void sched_kick(int32_t home);
+static void sleep_expired(int32_t pid);
+
 // Reference: https://wiki.osdev.org/Programmable_Interval_Timer
 // Reference: http://www.osdever.net/bkerndev/Docs/pit.htm
 
@@ -19,10 +58,23 @@ void init_scheduler(void){
     // Set command register mode to square wave
     outb(OPM_SQM3, PIT_CMDR);
 
-    // Set frequency divisor to 20HZ
-    // Divide 20Hz by 256
-    outb(DIV_20HZ & FREQ_MASK, PIT_CH0);  
-    outb(DIV_20HZ >> 8, PIT_CH0);
+    // Set frequency divisor to the tick rate
+    // Low byte first, then high byte
+    outb(pit_divisor & FREQ_MASK, PIT_CH0);  
+    outb(pit_divisor >> 8, PIT_CH0);
+
+    // No process is runnable until the first shell starts
+    int i, level;
+    for(i=0; i < MAX_CPUS; i++){
+        for(level=0; level < SCHED_LEVELS; level++){
+            pq_init(&cpus[i].run_queue[level]);
+        }
+        cpus[i].process = -1;
+        cpus[i].terminal = -1;
+        cpus[i].reap = -1;
+    }
+    pq_init(&dead_queue);
+    pq_init(&sleep_queue);
 
     // Enable PIT IRQ0
     enable_irq(IRQ_SCHED);
@@ -32,79 +84,739 @@ void init_scheduler(void){
 }
 
 
-/* void init_scheduler(void);
+/* void sched_handler(void);
  * Inputs: void
  * Return Value: none
- * Function: Schedules next process and performs context switch */
+ * Function: PIT tick, taken by the boot CPU when the PIT drives preemption.
+ * Forwards the tick to the other busy CPUs and runs the local tick */
 void sched_handler(void){
     // Send EOI to Master (IRQ0)
     send_eoi(IRQ_SCHED);
+    pit_ticks++;
+
+    // Idle CPUs are woken by sched_kick instead
+    int i;
+    for(i=0; i < num_cpus; i++){
+        if(i != this_cpu()->id && cpus[i].process != -1) send_ipi(i, TIMER_IDT);
+    }
+
+    sched_tick();
+}
 
-    // Check if any other terminals are active
-    //if(tmnl_block[1].flags == TMNL_IDLE && tmnl_block[2].flags == TMNL_IDLE) return;
 
-    // Find next scheduled process in round-robin
-    int next_terminal = (exec_terminal + 1) % NUM_TERMINAL;
+/* void sched_timer_handler(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Local APIC timer tick, or a PIT tick forwarded by the boot CPU */
+void sched_timer_handler(void){
+    lapic_eoi();
 
-    // If next terminal is running, schedule it
-    //save block for current process
-    pb_t* curr_pb = &(pcb[tmnl_block[exec_terminal].active_process]);
-    change_context(curr_pb, next_terminal);
+    // Pick up a tick rate changed on another CPU
+    cpu_t* cpu = this_cpu();
+    if(lapic_clock && cpu->timer_count != lapic_count){
+        lapic_timer_start(lapic_count);
+        cpu->timer_count = lapic_count;
+    }
 
+    sched_tick();
 }
 
 
-/* void change_context(void);
- * Inputs: sched_next
+/* void sched_ipi_handler(void);
+ * Inputs: void
  * Return Value: none
- * Function: Performs context switch */
-void change_context(pb_t* curr_pb, int sched_next){
-    //get pb_t pointer for next process
-    pb_t* next_pb = &(pcb[tmnl_block[sched_next].active_process]);
-    if(sched_next==active_terminal)
-    {
-        remap_vidmem(-1);
-    }else{
-        remap_vidmem(sched_next);
+ * Function: Kick sent to a halted CPU when work was queued for it */
+void sched_ipi_handler(void){
+    lapic_eoi();
+
+    // Already picked something up since the kick was sent
+    if(exec_process != -1) return;
+
+    int32_t next_pid = sched_pick();
+    if(next_pid == -1) return;
+    change_context(next_pid, pcb[next_pid].terminal);
+}
+
+
+/* void sched_tick(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Charges the tick to the current process, demoting it once its
+ * slice is used up, and switches to the highest priority runnable process */
+static void sched_tick(void){
+    cpu_t* cpu = this_cpu();
+    uint32_t start = (uint32_t)rdtsc();
+    cpu->ticks++;
+
+    // Fire the timers that came due since the last tick on any CPU
+    timer_run();
+
+    // Periodically lift everyone back to the top level so CPU hogs cannot starve
+    if(cpu->ticks - cpu->last_boost >= BOOST_MS * tick_hz / 1000){
+        sched_boost(cpu);
+        cpu->last_boost = cpu->ticks;
     }
- 
 
-    // Load user program for next scheduled process
-    if(tmnl_block[sched_next].flags==TMNL_RUN)
-    {
-        create_process_page(tmnl_block[sched_next].active_process);
+    int32_t next_pid = cpu->process;
+
+    // An idle CPU takes whatever it can find, here or on another CPU
+    if(next_pid == -1){
+        next_pid = sched_pick();
+    }
+    // Keep running the current process if nothing else is runnable
+    else if(sched_runnable() != 0 && charge_tick(next_pid)){
+        sched_enqueue(next_pid);
+        next_pid = sched_pick();
 
+        // Let an idle CPU take the rest of the queue
+        if(sched_runnable() != 0) sched_kick(cpu->id);
     }
 
-    //set tss params
-    //subtract 4 to get correct esp value
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = OFF_8MB - OFF_8KB * (tmnl_block[sched_next].active_process) - 4;
+    // Track tick overhead as a moving average (1/8 weight per sample)
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    tick_cycles = tick_cycles - (tick_cycles >> 3) + (cycles >> 3);
 
-    //save current processes stack and base pointer
-    asm volatile("                          \n\
-                    movl %%esp, %%eax       \n\
-                    movl %%ebp, %%ebx       \n\
-                "
-                :"=a"(curr_pb->prev_sp),"=b"(curr_pb->prev_bp));
-    
-    //schedule next terminal
-    exec_terminal = sched_next;
+    if(next_pid == cpu->process) return;
+    change_context(next_pid, pcb[next_pid].terminal);
+}
+
+
+/* int charge_tick(int32_t pid);
+ * Inputs: pid
+ * Return Value: 1 if the process should give up the CPU, 0 otherwise
+ * Function: Charges a tick to the running process, demoting it once its
+ * slice is used up */
+static int charge_tick(int32_t pid){
+    pb_t* curr = &pcb[pid];
+    curr->ticks_used++;
+
+    // Demote a process that used its whole slice
+    if(curr->ticks_used >= slice_ticks(pid)){
+        if(curr->level < SCHED_LEVELS-1) curr->level++;
+        curr->ticks_used = 0;
+        return 1;
+    }
+
+    // With slice left, only yield to a higher level
+    int level;
+    for(level=0; level < curr->level; level++){
+        if(this_cpu()->run_queue[level].count != 0) return 1;
+    }
+    return 0;
+}
+
+
+/* int32_t slice_ticks(int32_t pid);
+ * Inputs: pid
+ * Return Value: length of the process's current slice in ticks (at least 1)
+ * Function: Scales the process quantum by its level and converts it to ticks */
+static int32_t slice_ticks(int32_t pid){
+    uint32_t ms = pcb[pid].quantum_ms << pcb[pid].level;
+    uint32_t ticks = ms * tick_hz / 1000;
+    return (ticks == 0) ? 1 : ticks;
+}
+
+
+/* int32_t sched_set_tick(uint32_t hz);
+ * Inputs: hz
+ * Return Value: 0 for success, -1 for failure
+ * Function: Changes the PIT tick rate. Faster ticks cut preemption latency,
+ * slower ticks cut interrupt overhead for throughput workloads */
+int32_t sched_set_tick(uint32_t hz){
+    if(hz < TICK_HZ_MIN || hz > TICK_HZ_MAX) return -1;
+
+    uint32_t flags;
+    cli_and_save(flags);
+    tick_hz = hz;
+    pit_divisor = PIT_FREQ / hz;
+
+    // Other CPUs reload their timer on their next tick
+    if(lapic_clock){
+        lapic_count = lapic_per_ms * 1000 / hz;
+        if(!this_cpu()->tick_stopped){
+            lapic_timer_start(lapic_count);
+            this_cpu()->timer_count = lapic_count;
+        }
+    }
+
+    // A stopped tick picks up the new divisor when it restarts
+    if(!tick_stopped){
+        outb(OPM_SQM3, PIT_CMDR);
+        outb(pit_divisor & FREQ_MASK, PIT_CH0);
+        outb(pit_divisor >> 8, PIT_CH0);
+    }
+    restore_flags(flags);
+    return 0;
+}
+
+
+/* int32_t sched_set_quantum(int32_t pid, uint32_t ms);
+ * Inputs: pid, ms
+ * Return Value: 0 for success, -1 for failure
+ * Function: Sets the top level time slice of a process in milliseconds */
+int32_t sched_set_quantum(int32_t pid, uint32_t ms){
+    if(pid < 0 || pid >= num_pids || pcb[pid].flags != PCB_EXISTS) return -1;
+    if(ms == 0 || ms > QUANTUM_MS_MAX) return -1;
+
+    pcb[pid].quantum_ms = ms;
+    pcb[pid].ticks_used = 0;
+    return 0;
+}
+
+
+/* void sched_enqueue(int32_t pid);
+ * Inputs: pid
+ * Return Value: none
+ * Function: Queues a runnable process at the tail of its priority level on
+ * the CPU it last ran on */
+void sched_enqueue(int32_t pid){
+    pq_push(&cpus[pcb[pid].cpu].run_queue[pcb[pid].level], pid);
+}
+
+
+/* int32_t sched_pick(void);
+ * Inputs: void
+ * Return Value: pid of next process to run, -1 if none is runnable
+ * Function: Dequeues the head of this CPU's highest priority non-empty level,
+ * stealing from another CPU when this one has nothing queued */
+int32_t sched_pick(void){
+    cpu_t* cpu = this_cpu();
+    int level;
+    for(level=0; level < SCHED_LEVELS; level++){
+        if(cpu->run_queue[level].count != 0) return pq_pop(&cpu->run_queue[level]);
+    }
+    return sched_steal(cpu);
+}
+
+
+/* int32_t sched_steal(cpu_t* thief);
+ * Inputs: thief - CPU with an empty run queue
+ * Return Value: stolen pid, -1 if no CPU has anything queued
+ * Function: Takes the most recently queued process of the highest level
+ * from the CPU with the longest queue */
+static int32_t sched_steal(cpu_t* thief){
+    int32_t victim = -1;
+    int32_t most = 0;
+    int i;
+    for(i=0; i < num_cpus; i++){
+        if(i == thief->id) continue;
+        if(queued(&cpus[i]) > most){
+            most = queued(&cpus[i]);
+            victim = i;
+        }
+    }
+    if(victim == -1) return -1;
+
+    int level;
+    for(level=0; level < SCHED_LEVELS; level++){
+        pq_t* queue = &cpus[victim].run_queue[level];
+        if(queue->count != 0){
+            int32_t pid = queue->tail;
+            pq_remove(queue, pid);
+            pcb[pid].cpu = thief->id;
+            thief->steals++;
+            return pid;
+        }
+    }
+    return -1;
+}
+
+
+/* int32_t sched_runnable(void);
+ * Inputs: void
+ * Return Value: number of processes waiting to run on this CPU
+ * Function: Counts queued processes across all levels */
+int32_t sched_runnable(void){
+    return queued(this_cpu());
+}
+
+
+/* int32_t queued(cpu_t* cpu);
+ * Inputs: cpu
+ * Return Value: number of processes waiting to run on cpu
+ * Function: Counts queued processes across all levels */
+static int32_t queued(cpu_t* cpu){
+    int32_t count = 0;
+    int level;
+    for(level=0; level < SCHED_LEVELS; level++){
+        count += cpu->run_queue[level].count;
+    }
+    return count;
+}
+
+
+/* void sched_kick(int32_t home);
+ * Inputs: home - CPU preferred by the queued work
+ * Return Value: none
+ * Function: Wakes one halted CPU, home if it is idle, to run or steal
+ * newly queued work */
+static void sched_kick(int32_t home){
+    int32_t self = this_cpu()->id;
+    int32_t target = -1;
+
+    if(home != self && cpus[home].idle){
+        target = home;
+    }
+    else{
+        int i;
+        for(i=0; i < num_cpus; i++){
+            if(i != self && cpus[i].idle){
+                target = i;
+                break;
+            }
+        }
+    }
+    if(target == -1) return;
+
+    // Cleared here so one halt is not kicked twice
+    cpus[target].idle = 0;
+    send_ipi(target, IPI_IDT);
+}
+
+
+/* void sched_boost(cpu_t* cpu);
+ * Inputs: cpu
+ * Return Value: none
+ * Function: Moves every runnable process of a CPU back to the top priority level */
+static void sched_boost(cpu_t* cpu){
+    int level;
+    int32_t pid;
+    for(level=1; level < SCHED_LEVELS; level++){
+        while((pid = pq_pop(&cpu->run_queue[level])) != -1){
+            pcb[pid].level = 0;
+            pcb[pid].ticks_used = 0;
+            pq_push(&cpu->run_queue[0], pid);
+        }
+    }
+    if(cpu->process != -1){
+        pcb[cpu->process].level = 0;
+        pcb[cpu->process].ticks_used = 0;
+    }
+}
+
+
+/* void sched_idle(void);
+ * Inputs: void
+ * Return Value: none (never returns)
+ * Function: Idle task of a CPU, run on its boot stack. Starts the base shells,
+ * then halts whenever no process is runnable, stopping the tick once every
+ * CPU is idle */
+void sched_idle(void){
+    cpu_t* cpu = this_cpu();
+
+    while(1){
+        cli();
+
+        // Start the base shell of a terminal that is not running yet
+        int i;
+        for(i=0; i < NUM_TERMINAL; i++){
+            if(tmnl_block[i].flags == TMNL_IDLE) break;
+        }
+        if(i < NUM_TERMINAL){
+            spawn_shell(i);
+            continue;
+        }
+
+        // Someone was woken here or is waiting on another CPU
+        int32_t next_pid = sched_pick();
+        if(next_pid != -1){
+            change_context(next_pid, pcb[next_pid].terminal);
+            continue;
+        }
+
+        // Nothing to preempt, so stop the tick until an interrupt wakes a
+        // process. The boot CPU keeps it to run the timers that are armed
+        if(cpu->id == 0 && timers_pending() != 0) tick_start();
+        else tick_stop();
+
+        // Other CPUs may run kernel code while this one halts
+        cpu->idle_halts++;
+        cpu->idle = 1;
+        int32_t depth = kernel_unlock_all();
+        asm volatile("sti; hlt; cli" ::: "memory");
+        kernel_relock(depth);
+        cpu->idle = 0;
+    }
+}
+
+
+/* void sched_block(pq_t* wait_queue);
+ * Inputs: wait_queue
+ * Return Value: none
+ * Function: Sleeps the current process on a wait queue until it is woken,
+ * running other processes or the idle task in the meantime.
+ * Call with interrupts disabled */
+void sched_block(pq_t* wait_queue){
+    // Idle context has no PCB to queue, just wait for the next interrupt
+    if(exec_process == -1){
+        int32_t depth = kernel_unlock_all();
+        asm volatile("sti; hlt; cli" ::: "memory");
+        kernel_relock(depth);
+        return;
+    }
+
+    pcb[exec_process].state = PROC_BLOCKED;
+    pq_push(wait_queue, exec_process);
+
+    // Run the next process, or the idle task if there is none
+    int32_t next_pid = sched_pick();
+    if(next_pid == -1) change_context(-1, exec_terminal);
+    else change_context(next_pid, pcb[next_pid].terminal);
+}
 
-    //execute shell if not already running
-    if(tmnl_block[sched_next].flags==TMNL_IDLE)
+
+/* void sched_wake(pq_t* wait_queue);
+ * Inputs: wait_queue
+ * Return Value: none
+ * Function: Moves every process sleeping on a wait queue to the run queue.
+ * Processes that slept on I/O are interactive, so they go to the top level */
+void sched_wake(pq_t* wait_queue){
+    int32_t pid;
+    while((pid = pq_pop(wait_queue)) != -1){
+        sched_ready(pid);
+    }
+}
+
+
+/* void sched_ready(int32_t pid);
+ * Inputs: pid - process taken off a wait queue, or a new forked process
+ * Return Value: none
+ * Function: Queues a woken process at the top level and kicks its CPU */
+void sched_ready(int32_t pid){
+    pcb[pid].state = PROC_READY;
+    pcb[pid].level = 0;
+    pcb[pid].ticks_used = 0;
+    sched_enqueue(pid);
+    sched_kick(pcb[pid].cpu);
+}
+
+
+/* int32_t sched_sleep(uint32_t ms);
+ * Inputs: ms - time to sleep
+ * Return Value: 0 for success, -1 for failure
+ * Function: Blocks the current process until its sleep timer fires. The
+ * wakeup comes on the first tick after ms have passed */
+int32_t sched_sleep(uint32_t ms){
+    int32_t pid = exec_process;
+    if(pid == -1) return -1;
+    if(ms == 0) return 0;
+
+    uint32_t flags;
+    cli_and_save(flags);
+
+    timer_init(&pcb[pid].sleep_timer, sleep_expired, pid);
+    timer_add(&pcb[pid].sleep_timer, ms);
+
+    // The boot CPU runs the timers while idle, so get its tick going
+    if(this_cpu()->id != 0 && cpus[0].idle) send_ipi(0, IPI_IDT);
+
+    sched_block(&sleep_queue);
+    restore_flags(flags);
+    return 0;
+}
+
+
+/* void sleep_expired(int32_t pid);
+ * Inputs: pid - sleeping process
+ * Return Value: none
+ * Function: Sleep timer callback, wakes just the process it belongs to */
+static void sleep_expired(int32_t pid){
+    if(pcb[pid].state != PROC_BLOCKED) return;
+    pq_remove(&sleep_queue, pid);
+    sched_ready(pid);
+}
+
+
+/* void tick_stop(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Stops the tick of an idle CPU. The shared PIT is only masked
+ * once no CPU is running a process */
+void tick_stop(void){
+    cpu_t* cpu = this_cpu();
+    if(lapic_clock){
+        if(cpu->tick_stopped) return;
+        lapic_timer_stop();
+        cpu->tick_stopped = 1;
+        return;
+    }
+
+    if(tick_stopped || timers_pending() != 0) return;
+    int i;
+    for(i=0; i < num_cpus; i++){
+        if(cpus[i].process != -1) return;
+    }
+    disable_irq(IRQ_SCHED);
+    tick_stopped = 1;
+}
+
+
+/* void tick_start(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Restarts the tick with a full period when a CPU leaves idle */
+void tick_start(void){
+    cpu_t* cpu = this_cpu();
+    if(lapic_clock){
+        if(!cpu->tick_stopped) return;
+        lapic_timer_start(lapic_count);
+        cpu->timer_count = lapic_count;
+        cpu->tick_stopped = 0;
+        return;
+    }
+
+    if(!tick_stopped) return;
+
+    // Reloading the divisor restarts the count, giving a full slice
+    outb(OPM_SQM3, PIT_CMDR);
+    outb(pit_divisor & FREQ_MASK, PIT_CH0);
+    outb(pit_divisor >> 8, PIT_CH0);
+    enable_irq(IRQ_SCHED);
+    tick_stopped = 0;
+}
+
+
+/* int32_t sched_use_lapic(void);
+ * Inputs: void
+ * Return Value: 0 for success, -1 if the PIT has to stay in charge
+ * Function: Calibrates the local APIC timer against the PIT and hands
+ * preemption over to the per-CPU timers, masking the PIT for good */
+int32_t sched_use_lapic(void){
+    uint32_t per_ms = lapic_timer_calibrate();
+    if(per_ms == 0) return -1;
+
+    uint32_t flags;
+    cli_and_save(flags);
+    lapic_per_ms = per_ms;
+    lapic_count = per_ms * 1000 / tick_hz;
+    lapic_clock = 1;
+
+    disable_irq(IRQ_SCHED);
+    tick_stopped = 1;
+    sched_start_clock();
+    restore_flags(flags);
+    return 0;
+}
+
+
+/* void sched_start_clock(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Starts the calling CPU's local APIC timer if it drives preemption */
+void sched_start_clock(void){
+    cpu_t* cpu = this_cpu();
+    if(!lapic_clock) return;
+
+    lapic_timer_start(lapic_count);
+    cpu->timer_count = lapic_count;
+    cpu->tick_stopped = 0;
+}
+
+
+/* void change_context(int32_t next_pid, int next_terminal);
+ * Inputs: next_pid (-1 for the idle task), next_terminal
+ * Return Value: none
+ * Function: Performs context switch on the calling CPU */
+void change_context(int32_t next_pid, int next_terminal){
+    cpu_t* cpu = this_cpu();
+
+    // Load the address space of the next scheduled process, the idle task
+    // runs on the kernel's
+    if(next_pid == -1)
+    {
+        use_kernel_page_dir();
+    }
+    else
     {
-        tmnl_block[sched_next].flags=TMNL_RUN;
-        execute((uint8_t*)"shell");
+        create_process_page(next_pid);
+
+        //set tss params
+        //subtract 4 to get correct esp value
+        cpu->tss->ss0 = KERNEL_DS;
+        cpu->tss->esp0 = KSTACK_TOP(next_pid);
+
+        // Coming out of idle, the process needs the tick for preemption
+        pcb[next_pid].cpu = cpu->id;
+        cpu->idle = 0;
+        tick_start();
     }
 
-    //set next processes stack and base pointer
-    asm volatile("                          \n\
-                    movl %%eax, %%esp       \n\
-                    movl %%ebx, %%ebp       \n\
-                "
-                ::"a"(next_pb->prev_sp),"b"(next_pb->prev_bp));
-    return;
+    // Kernel stacks of the outgoing and incoming contexts
+    uint32_t* prev_sp = (cpu->process == -1) ? &cpu->idle_sp : &pcb[cpu->process].prev_sp;
+    uint32_t next_sp = (next_pid == -1) ? cpu->idle_sp : pcb[next_pid].prev_sp;
+
+    //schedule next process
+    cpu->terminal = next_terminal;
+    cpu->process = next_pid;
+    cpu->ctx_switches++;
+
+    // The kernel lock stays held across the switch, but each context
+    // unwinds its own nesting, so carry the depth with the stack
+    int32_t depth = cpu->lock_depth;
+
+    // Charge the outgoing context up to the switch
+    acct_switch();
+
+    // Time from here until some context resumes on the other side of a switch
+    switch_start = rdtsc();
+    switch_to(prev_sp, next_sp);
+
+    // Possibly resumed on another CPU
+    this_cpu()->lock_depth = depth;
+    reap_process();
+
+    // Fold the cost into a moving average (1/8 weight per sample)
+    uint32_t cycles = (uint32_t)(rdtsc() - switch_start);
+    switch_cycles = switch_cycles - (switch_cycles >> 3) + (cycles >> 3);
+}
+
+
+/* uint32_t init_kernel_stack(uint32_t stack_top, void (*entry)(void));
+ * Inputs: stack_top, entry
+ * Return Value: saved stack pointer to hand to switch_to
+ * Function: Primes a fresh kernel stack with the frame switch_to expects,
+ * so the first switch to it starts entry with interrupts disabled */
+uint32_t init_kernel_stack(uint32_t stack_top, void (*entry)(void)){
+    uint32_t* sp = (uint32_t*)stack_top;
+
+    *(--sp) = 0;                    // entry never returns
+    *(--sp) = (uint32_t)entry;      // popped by ret
+    *(--sp) = 0;                    // ebp
+    *(--sp) = 0;                    // ebx
+    *(--sp) = 0;                    // esi
+    *(--sp) = 0;                    // edi
+    *(--sp) = EFLAGS_INIT;          // popped by popfl
+
+    return (uint32_t)sp;
+}
+
+
+/* void shell_start(void);
+ * Inputs: void
+ * Return Value: none (never returns)
+ * Function: First code run by a spawned base shell, loads the shell program
+ * into the process the scheduler reserved for it */
+static void shell_start(void){
+    reap_process();
+    execute((uint8_t*)"shell");
+
+    // Only reached if the shell could not be loaded
+    printf("Could not start shell on terminal %d\n", exec_terminal);
+    while(1){
+        sched_block(&dead_queue);
+    }
+}
+
+
+/* void spawn_shell(int tmnl_id);
+ * Inputs: tmnl_id
+ * Return Value: none
+ * Function: Reserves a process for a terminal's base shell and queues it to
+ * run shell_start on its own kernel stack */
+static void spawn_shell(int tmnl_id){
+    int32_t pid = create_process(-1);
+    if(pid == -1) return;
+
+    tmnl_block[tmnl_id].flags = TMNL_RUN;
+    pcb[pid].terminal = tmnl_id;
+    pcb[pid].state = PROC_NEW;
+    pcb[pid].prev_sp = init_kernel_stack(KSTACK_TOP(pid), shell_start);
+    sched_enqueue(pid);
+}
+
+
+/* void print_sched_stats(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Prints scheduler counters and the contents of each CPU's queues */
+void print_sched_stats(void){
+    if(lapic_clock) printf("\ntick %u Hz from local APIC timers (%u counts/ms), %d CPUs\n", tick_hz, lapic_per_ms, num_cpus);
+    else printf("\ntick %u Hz from PIT, PIT ticks %u, %d CPUs\n", tick_hz, pit_ticks, num_cpus);
+    printf("tick overhead %u cycles, context switch %u cycles, %u timers armed\n", tick_cycles, switch_cycles, timers_pending());
+    printf("tlb flushes %u, invlpg %u, skipped %u\n", tlb_flushes, tlb_invlpgs, tlb_skips);
+
+    int i, level;
+    for(i=0; i < num_cpus; i++){
+        cpu_t* cpu = &cpus[i];
+        printf("cpu %d: ticks %u, switches %u, idle halts %u (%u ms), steals %u, ", i, cpu->ticks, cpu->ctx_switches, cpu->idle_halts, cycles_to_ms(cpu->idle_cycles), cpu->steals);
+        if(cpu->process == -1) printf("running: idle\n");
+        else printf("running: %d (level %d)\n", cpu->process, pcb[cpu->process].level);
+
+        for(level=0; level < SCHED_LEVELS; level++){
+            if(cpu->run_queue[level].count == 0) continue;
+            // Slices differ per process (set_quantum), shown as whole ticks
+            printf("  level %d:", level);
+            int32_t pid;
+            for(pid = cpu->run_queue[level].head; pid != -1; pid = pcb[pid].q_next){
+                printf(" %d (%u ms)", pid, slice_ticks(pid) * 1000 / tick_hz);
+            }
+            printf("\n");
+        }
+    }
+
+    // CPU time per process, as of each one's last accounting point
+    int32_t pid;
+    for(pid=0; pid < num_pids; pid++){
+        if(pcb[pid].flags == PCB_ABSENT) continue;
+        printf("pid %d: user %u ms, kernel %u ms\n", pid, cycles_to_ms(pcb[pid].user_cycles), cycles_to_ms(pcb[pid].kernel_cycles));
+    }
 }
 
 
+/* void pq_init(pq_t* queue);
+ * Inputs: queue
+ * Return Value: none
+ * Function: Initializes an empty process queue */
+void pq_init(pq_t* queue){
+    queue->head = -1;
+    queue->tail = -1;
+    queue->count = 0;
+}
+
+
+/* void pq_push(pq_t* queue, int32_t pid);
+ * Inputs: queue, pid
+ * Return Value: none
+ * Function: Appends a process to the tail of a queue in O(1) */
+void pq_push(pq_t* queue, int32_t pid){
+    pcb[pid].q_next = -1;
+    pcb[pid].q_prev = queue->tail;
+
+    if(queue->tail == -1) queue->head = pid;
+    else pcb[queue->tail].q_next = pid;
+    queue->tail = pid;
+    queue->count++;
+}
+
+
+/* int32_t pq_pop(pq_t* queue);
+ * Inputs: queue
+ * Return Value: pid at the head of the queue, -1 if empty
+ * Function: Removes the process at the head of a queue in O(1) */
+int32_t pq_pop(pq_t* queue){
+    int32_t pid = queue->head;
+    if(pid == -1) return -1;
+
+    pq_remove(queue, pid);
+    return pid;
+}
+
+
+/* void pq_remove(pq_t* queue, int32_t pid);
+ * Inputs: queue, pid
+ * Return Value: none
+ * Function: Unlinks a process from anywhere in a queue in O(1) */
+void pq_remove(pq_t* queue, int32_t pid){
+    int32_t prev = pcb[pid].q_prev;
+    int32_t next = pcb[pid].q_next;
+
+    if(prev == -1) queue->head = next;
+    else pcb[prev].q_next = next;
+
+    if(next == -1) queue->tail = prev;
+    else pcb[next].q_prev = prev;
+
+    pcb[pid].q_next = -1;
+    pcb[pid].q_prev = -1;
+    queue->count--;
+}
@@ -2,6 +2,15 @@
 #define _SCHEDULER_H
 
 #include "types.h"
+
+// Process queue, linked through the q_next/q_prev fields of the PCB.
+// Defined before the includes, PCB.h leads back here through rtc_handler.h
+typedef struct proc_queue {
+    int32_t head;
+    int32_t tail;
+    int32_t count;
+} pq_t;
+
 #include "PCB.h"
 
 #define PIT_CH0     0x40
@@ -10,15 +19,51 @@
 #define OPM_SQM3    0x36
 #define IRQ_SCHED   0x00
 
-#define DIV_20HZ	11932
+#define PIT_FREQ    1193182
 #define FREQ_MASK 	0xFF
 
+#define TICK_HZ_DEFAULT 20
+#define TICK_HZ_MIN     19          // slowest rate whose divisor fits in 16 bits
+#define TICK_HZ_MAX     1000
+
+#define SCHED_LEVELS    3
+#define QUANTUM_MS      50          // level 0 slice, doubled at each lower level
+#define QUANTUM_MS_MAX  1000
+#define BOOST_MS        1000
+
+#define EFLAGS_INIT     0x2         // reserved bit set, interrupts disabled
+
+void pq_init(pq_t* queue);
+void pq_push(pq_t* queue, int32_t pid);
+int32_t pq_pop(pq_t* queue);
+void pq_remove(pq_t* queue, int32_t pid);
+
 void init_scheduler(void);
 void sched_handler(void);
-void change_context(pb_t* curr_pb, int sched_next);
+void sched_ipi_handler(void);
+void sched_timer_handler(void);
+int32_t sched_use_lapic(void);
+void sched_start_clock(void);
+void sched_idle(void);
+void change_context(int32_t next_pid, int next_terminal);
+uint32_t init_kernel_stack(uint32_t stack_top, void (*entry)(void));
+void sched_block(pq_t* wait_queue);
+void sched_wake(pq_t* wait_queue);
+void tick_stop(void);
+void tick_start(void);
+int32_t sched_sleep(uint32_t ms);
+void sched_enqueue(int32_t pid);
+void sched_ready(int32_t pid);
+int32_t sched_pick(void);
+int32_t sched_runnable(void);
+void print_sched_stats(void);
+int32_t sched_set_tick(uint32_t hz);
+int32_t sched_set_quantum(int32_t pid, uint32_t ms);
 
-// Scheduled process (currently being executed)
-int exec_terminal;
+// Scheduled process (currently being executed) on the calling CPU
+#define exec_process    (this_cpu()->process)
+#define exec_terminal   (this_cpu()->terminal)
 
+#include "smp.h"
 
 #endif /* _SCHEDULER_H */
@@ -1,5 +1,6 @@
 #include "set_idt.h"
 #include "as_wrapper.h"
+#include "smp.h"
 
 //Exception handler declarations
 static void div_err();
@@ -16,7 +17,6 @@ static void invalid_tss();
 static void segment_not_present();
 static void stack_segment_fault();
 static void general_protection();
-static void page_fault();
 static void reserved();
 static void floating_point_error();
 static void alignment_check();
@@ -25,7 +25,14 @@ static void simd_floating_point_exception();
 static void assertion_failure();
 //static void system_call_handler();
 
+// Stacks of each CPU's double fault task (see double_fault)
+static uint8_t df_stack[MAX_CPUS][DF_STACK_SIZE] __attribute__((aligned (16)));
+
+static void exception_halt();
+
 //Array of function pointers to exception handlers
+//They are entered straight from the IDT, so each takes the kernel lock
+//itself, and halt hands it back through the parent's syscall return
 void* handlers[EXCEPTIONS] = 
 {
     div_err, debug,
@@ -35,7 +42,7 @@ void* handlers[EXCEPTIONS] =
     double_fault, coprocessor_segment_overrun,
     invalid_tss, segment_not_present,
     stack_segment_fault, general_protection,
-    page_fault, assertion_failure,
+    page_fault_wrapper, assertion_failure,
     floating_point_error, alignment_check,
     machine_check, simd_floating_point_exception,
     reserved, reserved, reserved, reserved,
@@ -44,15 +51,31 @@ void* handlers[EXCEPTIONS] =
 };
 
 
+/* exception_halt();
+ * Inputs: none
+ * Return Value: none, returns only for a base shell (which is not ended)
+ * Function: Ends the faulting process. halt's return path drops the
+ * kernel lock once, but a fault inside a system call holds it twice (the
+ * call's entry and the handler's), and the call's frames die with the
+ * process. So only one level is kept while halting */
+static void exception_halt()
+{
+    int32_t depth = kernel_lock_reset();
+    halt(0);
+    this_cpu()->lock_depth = depth;
+}
+
+
 /* assertion_failure();
  * Inputs: none
  * Return Value: none
  * Function: Called when an assertion failure exception is raised */
 static void assertion_failure()
 {
+    kernel_lock();
     clear();
     printf(" assertion failure\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -62,9 +85,10 @@ static void assertion_failure()
  * Function: Called when a division error exception is raised */
 static void div_err()
 {
+    kernel_lock();
     clear();
     printf(" dividing by zero\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -74,9 +98,10 @@ static void div_err()
  * Function: Called when a debug exception is raised */
 static void debug()
 {
+    kernel_lock();
     clear();
     printf(" debug\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -86,9 +111,10 @@ static void debug()
  * Function: Called when an nmi_int exception is raised */
 static void nmi_int()
 {
+    kernel_lock();
     clear();
     printf(" non-maskable interrupt\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -98,9 +124,10 @@ static void nmi_int()
  * Function: Called when a breakpoint exception is raised */
 static void breakpoint()
 {
+    kernel_lock();
     clear();
     printf(" breakpoint detected\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -110,9 +137,10 @@ static void breakpoint()
  * Function: Called when an overflow exception is raised */
 static void overflow()
 {
+    kernel_lock();
     clear();
     printf(" overflow detected\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -122,9 +150,10 @@ static void overflow()
  * Function: Called when a bound range exceeded exception is raised */
 static void bound_range_exceeded()
 {
+    kernel_lock();
     clear();
     printf(" bound range exceeded\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -134,9 +163,10 @@ static void bound_range_exceeded()
  * Function: Called when an invalid opcode exception is raised */
 static void invalid_opcode()
 {
+    kernel_lock();
     clear();
     printf(" invalid opcode\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -146,21 +176,87 @@ static void invalid_opcode()
  * Function: Called when a device not available exception is raised */
 static void device_not_available()
 {
+    kernel_lock();
     clear();
     printf(" device not available\n");
-    halt(0);
+    exception_halt();
+}
+
+
+/* setup_df_task(int32_t id);
+ * Inputs: id - cpu id
+ * Return Value: none
+ * Function: Constructs the GDT entry and TSS of a CPU's double fault task,
+ * which runs in the kernel's address space with interrupts off, on a
+ * stack of its own */
+void setup_df_task(int32_t id)
+{
+    tss_t* df_tss = &cpus[id].df_tss;
+    seg_desc_t the_tss_desc;
+    the_tss_desc.granularity   = 0x0;
+    the_tss_desc.opsize        = 0x0;
+    the_tss_desc.reserved      = 0x0;
+    the_tss_desc.avail         = 0x0;
+    the_tss_desc.seg_lim_19_16 = TSS_SIZE & 0x000F0000;
+    the_tss_desc.present       = 0x1;
+    the_tss_desc.dpl           = 0x0;
+    the_tss_desc.sys           = 0x0;
+    the_tss_desc.type          = TSS_AVAIL;
+    the_tss_desc.seg_lim_15_00 = TSS_SIZE & 0x0000FFFF;
+
+    SET_TSS_PARAMS(the_tss_desc, df_tss, tss_size);
+    df_tss_desc_ptr[id] = the_tss_desc;
+
+    df_tss->ldt_segment_selector = KERNEL_LDT;
+    df_tss->cr3 = (uint32_t)page_directory;
+    df_tss->eip = (uint32_t)double_fault;
+    df_tss->eflags = EFLAGS_INIT;
+    df_tss->esp = (uint32_t)df_stack[id] + DF_STACK_SIZE;
+    df_tss->cs = KERNEL_CS;
+    df_tss->ss = KERNEL_DS;
+    df_tss->ds = KERNEL_DS;
+    df_tss->es = KERNEL_DS;
+    df_tss->fs = KERNEL_DS;
+    df_tss->gs = KERNEL_DS;
 }
 
 
 /* double_fault();
  * Inputs: none
  * Return Value: none
- * Function: Called when a double failure exception is raised */
+ * Function: Entry point of the double fault task. Running on its own stack
+ * lets a kernel stack overflow (no room left to push the page fault) end
+ * the process instead of resetting the machine */
 static void double_fault()
 {
+    uint16_t df_sel;
+    uint32_t addr;
+
+    // Each CPU has its own task, so the task register names the CPU
+    asm volatile("str %0" : "=r"(df_sel));
+    int32_t id = (df_sel - DF_TSS) >> 3;
+    uint16_t sel = cpus[id].df_tss.prev_task_link;
+
+    // Become the faulting CPU's task again, so this_cpu() works and iret
+    // does not switch back to the dead context. A second double fault on
+    // this CPU before it is off its df_stack would reuse it
+    if(sel == KERNEL_TSS) tss_desc_ptr.type = TSS_AVAIL;
+    else ap_tss_desc_ptr[(sel - AP_TSS) >> 3].type = TSS_AVAIL;
+    ltr(sel);
+    df_tss_desc_ptr[id].type = TSS_AVAIL;
+    asm volatile("pushfl; andl %0, (%%esp); popfl" : : "i"(~EFLAGS_NT) : "cc");
+    asm volatile("movl %%cr2, %0" : "=r"(addr));
+
+    kernel_lock();
+    if(exec_process != -1) create_process_page(exec_process);
+
     clear();
-    printf(" double fault\n");
-    halt(0);
+    if(kstack_guard_pid(addr) != -1) printf(" kernel stack overflow (pid %d)\n", kstack_guard_pid(addr));
+    else printf(" double fault\n");
+    exception_halt();
+
+    // Base shells are not ended, and there is no context to go back to
+    while(1) asm volatile("hlt");
 }
 
 
@@ -170,9 +266,10 @@ static void double_fault()
  * Function: Called when a coprocessor segment overrun exception is raised */
 static void coprocessor_segment_overrun()
 {
+    kernel_lock();
     clear();
     printf(" coprocessor segment overrun\n");
-    halt(0);
+    exception_halt();
 }
 
 /* invalid_tss();
@@ -181,9 +278,10 @@ static void coprocessor_segment_overrun()
  * Function: Called when an invalid tss exception is raised */
 static void invalid_tss()
 {
+    kernel_lock();
     clear();
     printf(" invalid tss\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -193,9 +291,10 @@ static void invalid_tss()
  * Function: Called when a segment not present exception is raised */
 static void segment_not_present()
 {
+    kernel_lock();
     clear();
     printf(" segment not present\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -205,9 +304,10 @@ static void segment_not_present()
  * Function: Called when a stack segment fault exception is raised */
 static void stack_segment_fault()
 {
+    kernel_lock();
     clear();
     printf(" stack segment fault\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -217,21 +317,31 @@ static void stack_segment_fault()
  * Function: Called when a general protection exception is raised */
 static void general_protection()
 {
+    kernel_lock();
     clear();
     printf(" general protection\n");
-    halt(0);
+    exception_halt();
 }
 
 
-/* page_fault();
- * Inputs: none
- * Return Value: none
- * Function: Called when a page fault exception is raised */
-static void page_fault()
+/* page_fault_handler(uint32_t addr, uint32_t error);
+ * Inputs: addr - faulting address (cr2), error - error code pushed by the CPU
+ * Return Value: none, returns only if the fault was resolved
+ * Function: Called from page_fault_wrapper when a page fault exception is raised */
+void page_fault_handler(uint32_t addr, uint32_t error)
 {
+    if(exec_process != -1){
+        // First touch of a program page that is loaded lazily
+        if(!(error & PF_PRESENT) && demand_page(exec_process, addr) == 0) return;
+
+        // First write to a page still shared with the filesystem image
+        if((error & PF_PRESENT) && (error & PF_WRITE) && copy_on_write(exec_process, addr) == 0) return;
+    }
+
     clear();
-    printf(" page fault\n");
-    halt(0);
+    if(kstack_guard_pid(addr) != -1) printf(" kernel stack overflow (pid %d)\n", kstack_guard_pid(addr));
+    else printf(" page fault at 0x%x\n", addr);
+    exception_halt();
 }
 
 
@@ -241,9 +351,10 @@ static void page_fault()
  * Function: Called when an Intel reserved exception is raised */
 static void reserved()
 {
+    kernel_lock();
     clear();
     printf(" reserved\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -253,9 +364,10 @@ static void reserved()
  * Function: Called when a floating point error exception is raised */
 static void floating_point_error()
 {
+    kernel_lock();
     clear();
     printf(" floating point error\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -265,9 +377,10 @@ static void floating_point_error()
  * Function: Called when an alignment check exception is raised */
 static void alignment_check()
 {
+    kernel_lock();
     clear();
     printf(" alignment check\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -277,9 +390,10 @@ static void alignment_check()
  * Function: Called when a machine check exception is raised */
 static void machine_check()
 {
+    kernel_lock();
     clear();
     printf(" machine check\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -289,9 +403,10 @@ static void machine_check()
  * Function: Called when a SIMD floating point exception is raised */
 static void simd_floating_point_exception()
 {
+    kernel_lock();
     clear();
     printf(" simd floating point exception\n");
-    halt(0);
+    exception_halt();
 }
 
 
@@ -367,5 +482,67 @@ void init_idt()
     idt[PIT_IDT].reserved4 = RES_INT4;
     SET_IDT_ENTRY(idt[PIT_IDT], sched_pit_wrapper);
 
+    //IDT entry for scheduler IPIs from other CPUs
+    idt[IPI_IDT].present = PRESENT;
+    idt[IPI_IDT].dpl = KRNL_PRIV;
+    idt[IPI_IDT].seg_selector = KERNEL_CS;
+    idt[IPI_IDT].size = SIZE;
+    idt[IPI_IDT].reserved0 = RES_INT0;        
+    idt[IPI_IDT].reserved1 = RES_INT1;
+    idt[IPI_IDT].reserved2 = RES_INT2;
+    idt[IPI_IDT].reserved3 = RES_INT3;
+    idt[IPI_IDT].reserved4 = RES_INT4;
+    SET_IDT_ENTRY(idt[IPI_IDT], sched_ipi_wrapper);
+
+    //IDT entry for local APIC timer (and forwarded PIT) ticks
+    idt[TIMER_IDT].present = PRESENT;
+    idt[TIMER_IDT].dpl = KRNL_PRIV;
+    idt[TIMER_IDT].seg_selector = KERNEL_CS;
+    idt[TIMER_IDT].size = SIZE;
+    idt[TIMER_IDT].reserved0 = RES_INT0;        
+    idt[TIMER_IDT].reserved1 = RES_INT1;
+    idt[TIMER_IDT].reserved2 = RES_INT2;
+    idt[TIMER_IDT].reserved3 = RES_INT3;
+    idt[TIMER_IDT].reserved4 = RES_INT4;
+    SET_IDT_ENTRY(idt[TIMER_IDT], sched_timer_wrapper);
+
+    //IDT entry for TLB shootdowns from other CPUs
+    idt[TLB_IDT].present = PRESENT;
+    idt[TLB_IDT].dpl = KRNL_PRIV;
+    idt[TLB_IDT].seg_selector = KERNEL_CS;
+    idt[TLB_IDT].size = SIZE;
+    idt[TLB_IDT].reserved0 = RES_INT0;        
+    idt[TLB_IDT].reserved1 = RES_INT1;
+    idt[TLB_IDT].reserved2 = RES_INT2;
+    idt[TLB_IDT].reserved3 = RES_INT3;
+    idt[TLB_IDT].reserved4 = RES_INT4;
+    SET_IDT_ENTRY(idt[TLB_IDT], tlb_ipi_wrapper);
+
+    //IDT entry for local APIC spurious interrupts
+    idt[SPUR_IDT].present = PRESENT;
+    idt[SPUR_IDT].dpl = KRNL_PRIV;
+    idt[SPUR_IDT].seg_selector = KERNEL_CS;
+    idt[SPUR_IDT].size = SIZE;
+    idt[SPUR_IDT].reserved0 = RES_INT0;        
+    idt[SPUR_IDT].reserved1 = RES_INT1;
+    idt[SPUR_IDT].reserved2 = RES_INT2;
+    idt[SPUR_IDT].reserved3 = RES_INT3;
+    idt[SPUR_IDT].reserved4 = RES_INT4;
+    SET_IDT_ENTRY(idt[SPUR_IDT], spurious_wrapper);
+
+    //Double faults switch to a task of their own. This is the boot
+    //CPU's, each AP's IDT names its own (see setup_ap_idt)
+    setup_df_task(0);
+    idt[DF_IDT].present = PRESENT;
+    idt[DF_IDT].dpl = KRNL_PRIV;
+    idt[DF_IDT].seg_selector = DF_TSS;
+    idt[DF_IDT].size = TASK_SIZE;
+    idt[DF_IDT].reserved0 = RES_INT0;
+    idt[DF_IDT].reserved1 = RES_TASK1;
+    idt[DF_IDT].reserved2 = RES_TASK2;
+    idt[DF_IDT].reserved3 = RES_TASK3;
+    idt[DF_IDT].reserved4 = RES_INT4;
+    SET_IDT_ENTRY(idt[DF_IDT], 0);
+
     return;
 }
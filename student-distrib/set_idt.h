@@ -12,6 +12,10 @@
 #define KB_IDT   0x21
 #define SYS_IDT  0x80
 #define PIT_IDT  0x20
+#define IPI_IDT  0xF0   // wakeup sent by another CPU
+#define TIMER_IDT 0xF1  // local APIC timer, or a PIT tick forwarded by the boot CPU
+#define TLB_IDT  0xF2   // TLB shootdown sent by another CPU
+#define SPUR_IDT 0xFF   // local APIC spurious interrupt
 
 #define KRNL_PRIV   0
 #define USR_PRIV    3
@@ -24,7 +28,22 @@
 #define RES_INT4    0
 #define RES_SYS3    1
 
+#define DF_IDT      0x08    // double fault, through a task gate
+#define RES_TASK1   1       // task gate type bits
+#define RES_TASK2   0
+#define RES_TASK3   1
+#define TASK_SIZE   0
+#define DF_STACK_SIZE 0x2000
+#define TSS_AVAIL   0x9     // TSS descriptor type, not busy
+#define EFLAGS_NT   0x4000  // nested task, iret would switch tasks
+
+#define PF_PRESENT  0x1     // page fault error code: page was present
+#define PF_WRITE    0x2
+#define PF_USER     0x4
+
 extern void* handlers[EXCEPTIONS];
 extern void init_idt();
+void setup_df_task(int32_t id);
+void page_fault_handler(uint32_t addr, uint32_t error);
 
 #endif /* _SET_IDT_H */
@@ -0,0 +1,198 @@
+#include "slab.h"
+#include "frame.h"
+#include "lib.h"
+
+// Reference: Bonwick, "The Slab Allocator: An Object-Caching Kernel Memory Allocator"
+
+// One cache per size class, set up on first use
+static kmem_cache_t caches[SLAB_CACHES];
+
+// Frames held by allocations too large for a cache
+static uint32_t large_frames = 0;
+
+static kmem_cache_t* cache_for(uint32_t size);
+static slab_t* slab_grow(kmem_cache_t* cache);
+static void slab_link(slab_t** list, slab_t* slab);
+static void slab_unlink(slab_t** list, slab_t* slab);
+
+
+/* void* kmalloc(uint32_t size);
+ * Inputs: size - bytes wanted
+ * Return Value: kernel memory (aligned to its size class, up to 16 bytes),
+ * NULL if none is free
+ * Function: Takes an object from the smallest size class that fits, or
+ * whole frames for anything larger than SLAB_MAX */
+void* kmalloc(uint32_t size){
+    void* obj = NULL;
+    uint32_t flags;
+
+    if(size == 0) return NULL;
+    cli_and_save(flags);
+
+    if(size > SLAB_MAX){
+        uint32_t frames = (size + SLAB_HDR + FRAME_SIZE - 1) >> FRAME_SHIFT;
+        slab_t* slab = (slab_t*)alloc_frames(frames, 1, FRAME_LOW);
+        if(slab != NULL){
+            slab->cache = NULL;
+            slab->frames = frames;
+            large_frames += frames;
+            obj = (uint8_t*)slab + SLAB_HDR;
+        }
+        restore_flags(flags);
+        return obj;
+    }
+
+    kmem_cache_t* cache = cache_for(size);
+    slab_t* slab = cache->partial;
+    if(slab == NULL) slab = slab_grow(cache);
+    if(slab != NULL){
+        obj = slab->free;
+        slab->free = *(void**)obj;
+        slab->in_use++;
+        cache->in_use++;
+        cache->allocs++;
+
+        // Out of objects, stop looking at it until one is freed
+        if(slab->free == NULL){
+            slab_unlink(&cache->partial, slab);
+            slab_link(&cache->full, slab);
+        }
+    }
+    restore_flags(flags);
+    return obj;
+}
+
+
+/* void* kzalloc(uint32_t size);
+ * Inputs: size - bytes wanted
+ * Return Value: zeroed kernel memory, NULL if none is free
+ * Function: kmalloc for structures that start out cleared */
+void* kzalloc(uint32_t size){
+    void* obj = kmalloc(size);
+    if(obj != NULL) memset(obj, 0, size);
+    return obj;
+}
+
+
+/* void kfree(void* ptr);
+ * Inputs: ptr - memory from kmalloc, or NULL
+ * Return Value: none
+ * Function: Returns an object to its slab, found from the frame it lies in.
+ * A slab left empty goes back to the frame allocator */
+void kfree(void* ptr){
+    uint32_t flags;
+
+    if(ptr == NULL) return;
+    cli_and_save(flags);
+
+    // Objects never start at a frame boundary, the header is there
+    slab_t* slab = (slab_t*)((uint32_t)ptr & ~(FRAME_SIZE - 1));
+    kmem_cache_t* cache = slab->cache;
+    if(cache == NULL){
+        large_frames -= slab->frames;
+        free_frames((uint32_t)slab, slab->frames);
+        restore_flags(flags);
+        return;
+    }
+
+    if(slab->free == NULL){
+        slab_unlink(&cache->full, slab);
+        slab_link(&cache->partial, slab);
+    }
+    *(void**)ptr = slab->free;
+    slab->free = ptr;
+    slab->in_use--;
+    cache->in_use--;
+    cache->frees++;
+
+    if(slab->in_use == 0){
+        slab_unlink(&cache->partial, slab);
+        cache->slabs--;
+        free_frames((uint32_t)slab, 1);
+    }
+    restore_flags(flags);
+}
+
+
+/* void print_slab_stats(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Prints the objects and slabs of each size class in use */
+void print_slab_stats(void){
+    int i;
+    printf("kmalloc: %u KB in large allocations\n", large_frames * (FRAME_SIZE / 1024));
+    for(i=0; i < SLAB_CACHES; i++){
+        kmem_cache_t* cache = &caches[i];
+        if(cache->allocs == 0) continue;
+        printf("  %u B: %u in use in %u slabs, %u allocs, %u frees\n",
+               cache->size, cache->in_use, cache->slabs, cache->allocs, cache->frees);
+    }
+}
+
+
+/* kmem_cache_t* cache_for(uint32_t size);
+ * Inputs: size - at most SLAB_MAX
+ * Return Value: smallest size class that fits
+ * Function: Finds the cache, filling in its geometry the first time */
+static kmem_cache_t* cache_for(uint32_t size){
+    int i = 0;
+    while((SLAB_MIN << i) < size) i++;
+
+    kmem_cache_t* cache = &caches[i];
+    if(cache->size == 0){
+        cache->size = SLAB_MIN << i;
+        cache->per_slab = (FRAME_SIZE - SLAB_HDR) / cache->size;
+    }
+    return cache;
+}
+
+
+/* slab_t* slab_grow(kmem_cache_t* cache);
+ * Inputs: cache - cache with no partial slab
+ * Return Value: new slab, NULL if no frame is free
+ * Function: Carves a frame into free objects and makes it the cache's
+ * partial slab */
+static slab_t* slab_grow(kmem_cache_t* cache){
+    slab_t* slab = (slab_t*)alloc_frames(1, 1, FRAME_LOW);
+    uint32_t i;
+
+    if(slab == NULL) return NULL;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->frames = 1;
+
+    // Chain the objects in address order
+    uint8_t* obj = (uint8_t*)slab + SLAB_HDR;
+    slab->free = obj;
+    for(i=0; i < cache->per_slab - 1; i++, obj += cache->size){
+        *(void**)obj = obj + cache->size;
+    }
+    *(void**)obj = NULL;
+
+    slab_link(&cache->partial, slab);
+    cache->slabs++;
+    return slab;
+}
+
+
+/* void slab_link(slab_t** list, slab_t* slab);
+ * Inputs: list - head of a slab list, slab
+ * Return Value: none
+ * Function: Pushes a slab on the front of a list */
+static void slab_link(slab_t** list, slab_t* slab){
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list != NULL) (*list)->prev = slab;
+    *list = slab;
+}
+
+
+/* void slab_unlink(slab_t** list, slab_t* slab);
+ * Inputs: list - head of the list holding slab, slab
+ * Return Value: none
+ * Function: Takes a slab out of a list */
+static void slab_unlink(slab_t** list, slab_t* slab){
+    if(slab->prev != NULL) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if(slab->next != NULL) slab->next->prev = slab->prev;
+}
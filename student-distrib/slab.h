@@ -0,0 +1,45 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "types.h"
+
+// Size classes from SLAB_MIN to SLAB_MAX bytes, doubling. Larger requests
+// get whole frames
+#define SLAB_MIN_SHIFT  4
+#define SLAB_MIN        (1 << SLAB_MIN_SHIFT)
+#define SLAB_CACHES     7
+#define SLAB_MAX        (SLAB_MIN << (SLAB_CACHES - 1))
+
+// Room kept at the start of each frame for its slab_t
+#define SLAB_HDR        32
+
+struct kmem_cache;
+
+// Header at the start of every frame kmalloc hands out
+typedef struct slab {
+    struct kmem_cache* cache;   // NULL for a large allocation
+    struct slab* next;          // in the cache's partial or full list
+    struct slab* prev;
+    void* free;                 // free objects, linked through their first word
+    uint32_t in_use;
+    uint32_t frames;            // frames of a large allocation
+} slab_t;
+
+// Objects of one size class, carved out of one frame slabs
+typedef struct kmem_cache {
+    uint32_t size;
+    uint32_t per_slab;
+    slab_t* partial;            // slabs with at least one free object
+    slab_t* full;
+    uint32_t slabs;
+    uint32_t in_use;
+    uint32_t allocs;
+    uint32_t frees;
+} kmem_cache_t;
+
+void* kmalloc(uint32_t size);
+void* kzalloc(uint32_t size);
+void kfree(void* ptr);
+void print_slab_stats(void);
+
+#endif /* _SLAB_H */
@@ -0,0 +1,391 @@
+#include "smp.h"
+#include "lib.h"
+#include "paging.h"
+#include "scheduler.h"
+#include "x86_desc.h"
+#include "set_idt.h"
+#include "clock.h"
+
+// Reference: https://wiki.osdev.org/Symmetric_Multiprocessing
+// Reference: https://wiki.osdev.org/APIC
+
+#define IO_DELAY_PORT   0x80
+
+// CPUs that have been brought up, indexed by cpu id
+cpu_t cpus[MAX_CPUS];
+int32_t num_cpus;
+
+// Mapped local APIC registers (NULL without an APIC)
+volatile uint32_t* lapic;
+
+// Stacks the CPUs boot and idle on
+uint8_t idle_stack[MAX_CPUS][IDLE_STACK_SIZE];
+
+// Real mode AP entry code and its GDT descriptor slot (see ap_boot.S)
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_gdt_desc[];
+extern volatile int32_t ap_next_id;
+
+// TSS of each application processor (CPU 0 uses tss)
+static tss_t ap_tss[MAX_CPUS - 1];
+
+// IDT of each application processor, a copy of idt whose double fault
+// gate names the AP's own task
+static idt_desc_t ap_idt[MAX_CPUS - 1][NUM_VEC] __attribute__((aligned (16)));
+static x86_desc_t ap_idt_desc[MAX_CPUS - 1];
+
+// Set by each AP once it is running kernel code
+static volatile int32_t cpu_online[MAX_CPUS];
+
+// Big kernel lock: 1 while some CPU runs kernel code
+static volatile uint32_t kernel_lock_word = 0;
+
+static void lapic_enable(void);
+static void lapic_send(uint32_t apic_id, uint32_t command);
+static void setup_ap_tss(int32_t id);
+static void setup_ap_idt(int32_t id);
+static void udelay(uint32_t us);
+
+
+/* uint32_t lapic_read(uint32_t reg);
+ * Inputs: reg - register offset
+ * Return Value: register value
+ * Function: Reads a local APIC register */
+static inline uint32_t lapic_read(uint32_t reg){
+    return lapic[reg >> 2];
+}
+
+
+/* void lapic_write(uint32_t reg, uint32_t val);
+ * Inputs: reg - register offset, val
+ * Return Value: none
+ * Function: Writes a local APIC register */
+static inline void lapic_write(uint32_t reg, uint32_t val){
+    lapic[reg >> 2] = val;
+}
+
+
+/* uint32_t xchg(volatile uint32_t* addr, uint32_t val);
+ * Inputs: addr, val
+ * Return Value: previous value at addr
+ * Function: Atomically swaps val into addr */
+static inline uint32_t xchg(volatile uint32_t* addr, uint32_t val){
+    asm volatile("lock; xchgl %0, %1"
+            : "+m"(*addr), "+r"(val)
+            :
+            : "memory", "cc"
+    );
+    return val;
+}
+
+
+/* void init_smp(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Sets up the per-CPU state, takes the kernel lock for the boot
+ * CPU and starts the other CPUs with the INIT-SIPI-SIPI sequence */
+void init_smp(void){
+    int i;
+    for(i=0; i < MAX_CPUS; i++){
+        cpus[i].id = i;
+        cpus[i].lock_depth = 0;
+        cpus[i].idle = 0;
+        cpus[i].tss = (i == 0) ? &tss : &ap_tss[i-1];
+    }
+    num_cpus = 1;
+
+    // The boot CPU runs kernel code from here on, until it first idles
+    kernel_lock();
+
+    // Without a local APIC there is nothing to start
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if(!(edx & CPUID_APIC)){
+        printf("No local APIC, running on one CPU\n");
+        return;
+    }
+
+    uint32_t base_lo, base_hi;
+    asm volatile("rdmsr" : "=a"(base_lo), "=d"(base_hi) : "c"(APIC_BASE_MSR));
+    map_kernel_mmio(base_lo & APIC_BASE_MASK);
+    lapic = (volatile uint32_t*)(base_lo & APIC_BASE_MASK);
+    lapic_enable();
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> LAPIC_ID_SHIFT;
+
+    for(i=1; i < MAX_CPUS; i++){
+        setup_ap_tss(i);
+        setup_df_task(i);
+        setup_ap_idt(i);
+    }
+
+    // Copy the trampoline below 1MB, where a startup IPI can point
+    map_kernel_page(TRAMPOLINE_ADDR);
+    memcpy((void*)TRAMPOLINE_ADDR, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    memcpy((void*)(TRAMPOLINE_ADDR + (ap_gdt_desc - ap_trampoline)), &gdt_desc, 6);
+
+    // INIT, then two startup IPIs, to every other CPU
+    lapic_send(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+    udelay(INIT_DELAY_US);
+    for(i=0; i < 2; i++){
+        lapic_send(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_STARTUP | (TRAMPOLINE_ADDR >> 12));
+        udelay(SIPI_DELAY_US);
+    }
+
+    // The APs wait on the kernel lock until the boot CPU idles
+    udelay(AP_WAIT_US);
+    unmap_kernel_page(TRAMPOLINE_ADDR);
+
+    int32_t online = 1;
+    for(i=1; i < MAX_CPUS; i++){
+        if(cpu_online[i]) online++;
+    }
+    printf("%d CPUs online\n", online);
+    if(ap_next_id > MAX_CPUS) printf("Parked %d CPUs\n", ap_next_id - MAX_CPUS);
+}
+
+
+/* void ap_main(int32_t id);
+ * Inputs: id - cpu id claimed in ap_start32
+ * Return Value: none (never returns)
+ * Function: C entry point of an application processor. Loads its
+ * descriptors, enables its local APIC and becomes an idle task */
+void ap_main(int32_t id){
+    lidt(&ap_idt_desc[id-1].size);
+    ltr(AP_TSS + ((id - 1) << 3));
+    lapic_enable();
+    cpus[id].apic_id = lapic_read(LAPIC_ID) >> LAPIC_ID_SHIFT;
+    cpu_online[id] = 1;
+
+    kernel_lock();
+    if(id >= num_cpus) num_cpus = id + 1;
+    cpus[id].acct_stamp = rdtsc();
+    sched_start_clock();
+    sched_idle();
+}
+
+
+/* void setup_ap_tss(int32_t id);
+ * Inputs: id - cpu id of an AP
+ * Return Value: none
+ * Function: Constructs the GDT entry of an AP's TSS */
+static void setup_ap_tss(int32_t id){
+    seg_desc_t the_tss_desc;
+    the_tss_desc.granularity   = 0x0;
+    the_tss_desc.opsize        = 0x0;
+    the_tss_desc.reserved      = 0x0;
+    the_tss_desc.avail         = 0x0;
+    the_tss_desc.seg_lim_19_16 = TSS_SIZE & 0x000F0000;
+    the_tss_desc.present       = 0x1;
+    the_tss_desc.dpl           = 0x0;
+    the_tss_desc.sys           = 0x0;
+    the_tss_desc.type          = 0x9;
+    the_tss_desc.seg_lim_15_00 = TSS_SIZE & 0x0000FFFF;
+
+    SET_TSS_PARAMS(the_tss_desc, cpus[id].tss, tss_size);
+
+    ap_tss_desc_ptr[id-1] = the_tss_desc;
+
+    cpus[id].tss->ldt_segment_selector = KERNEL_LDT;
+    cpus[id].tss->ss0 = KERNEL_DS;
+    cpus[id].tss->esp0 = (uint32_t)idle_stack[id] + IDLE_STACK_SIZE;
+}
+
+
+/* void setup_ap_idt(int32_t id);
+ * Inputs: id - cpu id of an AP
+ * Return Value: none
+ * Function: Copies the boot CPU's IDT for an AP, pointing its double fault
+ * gate at the AP's own task. Call after init_idt */
+static void setup_ap_idt(int32_t id){
+    memcpy(ap_idt[id-1], idt, sizeof(idt));
+    ap_idt[id-1][DF_IDT].seg_selector = DF_TSS + (id << 3);
+
+    ap_idt_desc[id-1].size = sizeof(idt) - 1;
+    ap_idt_desc[id-1].addr = (uint32_t)ap_idt[id-1];
+}
+
+
+/* void lapic_enable(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Software enables the calling CPU's local APIC and accepts
+ * all interrupt priorities */
+static void lapic_enable(void){
+    lapic_write(LAPIC_SVR, SVR_ENABLE | SPUR_IDT);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+
+/* void lapic_eoi(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Acknowledges the interrupt the local APIC is delivering */
+void lapic_eoi(void){
+    lapic_write(LAPIC_EOI, 0);
+}
+
+
+/* uint32_t lapic_timer_calibrate(void);
+ * Inputs: void
+ * Return Value: local APIC timer counts per millisecond, 0 without an APIC
+ * Function: Counts down the local APIC timer while PIT channel 2 runs a
+ * CALIBRATE_MS one-shot. Channel 0 keeps ticking undisturbed */
+uint32_t lapic_timer_calibrate(void){
+    if(lapic == NULL) return 0;
+
+    uint32_t flags;
+    cli_and_save(flags);
+
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    // Start both counters, then wait for the one-shot to run out
+    pit_oneshot_start(CALIBRATE_MS);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_oneshot_wait();
+
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    restore_flags(flags);
+
+    return elapsed / CALIBRATE_MS;
+}
+
+
+/* void lapic_timer_start(uint32_t count);
+ * Inputs: count - timer counts per tick
+ * Return Value: none
+ * Function: Runs the calling CPU's local APIC timer periodically */
+void lapic_timer_start(uint32_t count){
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_PERIODIC | TIMER_IDT);
+    lapic_write(LAPIC_TIMER_INIT, count);
+}
+
+
+/* void lapic_timer_stop(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Stops and masks the calling CPU's local APIC timer */
+void lapic_timer_stop(void){
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+
+/* void lapic_send(uint32_t apic_id, uint32_t command);
+ * Inputs: apic_id - destination (ignored with a shorthand), command
+ * Return Value: none
+ * Function: Sends an interprocessor interrupt and waits until it is delivered */
+static void lapic_send(uint32_t apic_id, uint32_t command){
+    lapic_write(LAPIC_ICR_HI, apic_id << LAPIC_ID_SHIFT);
+    lapic_write(LAPIC_ICR_LO, command);
+    while(lapic_read(LAPIC_ICR_LO) & ICR_PENDING);
+}
+
+
+/* void send_ipi(int32_t cpu_id, uint8_t vector);
+ * Inputs: cpu_id, vector
+ * Return Value: none
+ * Function: Raises an interrupt on another CPU */
+void send_ipi(int32_t cpu_id, uint8_t vector){
+    lapic_send(cpus[cpu_id].apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+
+/* void udelay(uint32_t us);
+ * Inputs: us
+ * Return Value: none
+ * Function: Busy waits roughly us microseconds (one ISA bus write each) */
+static void udelay(uint32_t us){
+    while(us-- > 0){
+        outb(0, IO_DELAY_PORT);
+    }
+}
+
+
+/* void kernel_lock(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Takes the big kernel lock on kernel entry. Nested entries on the
+ * CPU that holds it (an interrupt during a system call) only count depth */
+void kernel_lock(void){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    cpu_t* cpu = this_cpu();
+    if(cpu->lock_depth++ == 0){
+        while(xchg(&kernel_lock_word, 1) != 0){
+            while(kernel_lock_word != 0){
+                asm volatile("pause");
+            }
+        }
+    }
+    restore_flags(flags);
+}
+
+
+/* void kernel_unlock(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Drops one level of the big kernel lock on kernel exit */
+void kernel_unlock(void){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    cpu_t* cpu = this_cpu();
+    if(--cpu->lock_depth == 0){
+        xchg(&kernel_lock_word, 0);
+    }
+    restore_flags(flags);
+}
+
+
+/* int32_t kernel_unlock_all(void);
+ * Inputs: void
+ * Return Value: depth held before the call
+ * Function: Releases the big kernel lock completely, before halting or
+ * returning to user mode outside the interrupt wrappers */
+int32_t kernel_unlock_all(void){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    cpu_t* cpu = this_cpu();
+    int32_t depth = cpu->lock_depth;
+    if(depth != 0){
+        cpu->lock_depth = 0;
+        xchg(&kernel_lock_word, 0);
+    }
+    restore_flags(flags);
+    return depth;
+}
+
+
+/* void kernel_relock(int32_t depth);
+ * Inputs: depth - returned by kernel_unlock_all
+ * Return Value: none
+ * Function: Takes the big kernel lock back at its previous depth */
+void kernel_relock(int32_t depth){
+    if(depth == 0) return;
+
+    uint32_t flags;
+    cli_and_save(flags);
+    kernel_lock();
+    this_cpu()->lock_depth = depth;
+    restore_flags(flags);
+}
+
+
+/* int32_t kernel_lock_reset(void);
+ * Inputs: void
+ * Return Value: depth held before the call
+ * Function: Keeps a single level of the big kernel lock, for a context
+ * abandoning the entries nested under it (a process killed by a fault
+ * inside a system call) whose one remaining exit drops the last level */
+int32_t kernel_lock_reset(void){
+    cpu_t* cpu = this_cpu();
+    int32_t depth = cpu->lock_depth;
+    cpu->lock_depth = 1;
+    return depth;
+}
@@ -0,0 +1,104 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include "types.h"
+#include "x86_desc.h"
+#include "scheduler.h"
+
+// Local APIC registers (offsets from the APIC base)
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LO    0x300
+#define LAPIC_ICR_HI    0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+
+#define LAPIC_ID_SHIFT  24
+#define SVR_ENABLE      0x100
+#define ICR_FIXED       0x00000000
+#define ICR_INIT        0x00000500
+#define ICR_STARTUP     0x00000600
+#define ICR_PENDING     0x00001000
+#define ICR_ASSERT      0x00004000
+#define ICR_ALL_BUT_SELF 0x000C0000
+#define LVT_MASKED      0x00010000
+#define LVT_PERIODIC    0x00020000
+#define TIMER_DIV_16    0x3
+
+#define APIC_BASE_MSR   0x1B
+#define APIC_BASE_MASK  0xFFFFF000
+#define CPUID_APIC      0x200       // CPUID.1:EDX APIC present bit
+
+// Real mode entry point of the APs (SIPI vector = address >> 12)
+#define TRAMPOLINE_ADDR 0x8000
+
+// Delays of the INIT-SIPI-SIPI sequence in microseconds
+#define INIT_DELAY_US   10000
+#define SIPI_DELAY_US   200
+#define AP_WAIT_US      100000
+
+// Per-CPU state
+typedef struct cpu {
+    int32_t id;
+    uint32_t apic_id;
+    int32_t process;                // running pid, -1 for the idle task
+    int terminal;                   // terminal of the running pid
+    pq_t run_queue[SCHED_LEVELS];   // runnable processes homed on this CPU
+    uint32_t idle_sp;               // saved kernel stack of the idle task
+    int32_t lock_depth;             // kernel lock nesting of the running context
+    int32_t reap;                   // process that ended itself here, its
+                                    // kernel stack is freed once off it
+    int32_t idle;                   // set while halted in the idle task
+    tss_t* tss;
+    tss_t df_tss;                   // task double faults switch to
+    int32_t tick_stopped;           // local APIC timer stopped while idle
+    uint32_t timer_count;           // local APIC timer count per tick
+    uint32_t ticks;
+    uint32_t last_boost;
+    uint32_t ctx_switches;
+    uint32_t idle_halts;
+    uint32_t steals;
+    uint64_t acct_stamp;            // TSC at the last CPU time accounting point
+    uint64_t idle_cycles;
+} cpu_t;
+
+void init_smp(void);
+void ap_main(int32_t id);
+void lapic_eoi(void);
+uint32_t lapic_timer_calibrate(void);
+void lapic_timer_start(uint32_t count);
+void lapic_timer_stop(void);
+void send_ipi(int32_t cpu_id, uint8_t vector);
+void kernel_lock(void);
+void kernel_unlock(void);
+int32_t kernel_unlock_all(void);
+void kernel_relock(int32_t depth);
+int32_t kernel_lock_reset(void);
+
+// CPUs that have been brought up, indexed by cpu id
+extern cpu_t cpus[MAX_CPUS];
+extern int32_t num_cpus;
+
+// Mapped local APIC registers (NULL without an APIC)
+extern volatile uint32_t* lapic;
+
+// Stacks the CPUs boot and idle on
+extern uint8_t idle_stack[MAX_CPUS][IDLE_STACK_SIZE];
+
+
+/* cpu_t* this_cpu(void);
+ * Inputs: void
+ * Return Value: state of the CPU executing the call
+ * Function: Each CPU loads its own TSS, so the task register names the CPU */
+static inline cpu_t* this_cpu(void) {
+    uint16_t sel;
+    asm volatile ("str %0" : "=r"(sel));
+    if (sel == KERNEL_TSS) return &cpus[0];
+    return &cpus[((sel - AP_TSS) >> 3) + 1];
+}
+
+#endif /* _SMP_H */
@@ -6,6 +6,8 @@
 #include "x86_desc.h"
 #include "keyboard_handler.h"
 #include "scheduler.h"
+#include "clock.h"
+#include "as_wrapper.h"
 
 #define TYPE_RTC    0
 #define TYPE_DIR    1
@@ -20,14 +22,17 @@
 #define CMD_SIZE    32
 #define USER_ESP    0x083FFFFC
 #define ENTRY_OFF   24
-#define VIDM_ADDR   0x8800000
 
 // Extern instantiation of PCB
-extern pb_t pcb[PCB_SIZE];
+extern pb_t* pcb;
 
 // Extern declaration of rtc fileops table
 extern file_op_t rtc_fileops;
 
+// Moving averages of the cycles spent in fork and in execute
+uint32_t fork_cycles;
+uint32_t exec_cycles;
+
 /*int32_t parse_cmd(const uint8_t* command, uint8_t buffer[32])
 * Inputs: command, buffer
 * Return value: length of command
@@ -63,7 +68,7 @@ int32_t parse_cmd(const uint8_t* command, uint8_t buffer[CMD_SIZE]){
     if(command[arg_start] == '\0') return cmd_start;
 
     // Get process to save argument to
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
 
     // Parse argument
     int j = arg_start;
@@ -85,7 +90,7 @@ int32_t parse_cmd(const uint8_t* command, uint8_t buffer[CMD_SIZE]){
 */
 int32_t halt (uint8_t status){
     // Previous and current process data
-    int sched_process = tmnl_block[exec_terminal].active_process;
+    int sched_process = exec_process;
     int32_t prev_process = pcb[sched_process].parent;
     uint32_t child_stack = pcb[sched_process].stack_ptr;
     uint32_t child_base = pcb[sched_process].base_ptr;
@@ -96,25 +101,45 @@ int32_t halt (uint8_t status){
         return 0;
     }
 
-    // Close open files in process FDT
+    // Close open files in process FDT, so their state is freed
     int i;
-    for(i=3; i < FDT_SIZE; i++){
-        if(pcb[tmnl_block[exec_terminal].active_process].fd_table[i].flags == FD_EXISTS){
+    for(i=2; i < FDT_SIZE; i++){
+        if(pcb[exec_process].fd_table[i].flags == FD_EXISTS){
             close(i);
         }
     }
 
-    // Set base terminal's child process to parent of halting process, or terminal itself
-    tmnl_block[exec_terminal].active_process = prev_process;
+    // Processes it forked now belong to its parent
+    for(i=0; i < num_pids; i++){
+        if(pcb[i].flags == PCB_EXISTS && pcb[i].parent == sched_process) pcb[i].parent = prev_process;
+    }
 
-    // End current process
+    // End current process, its kernel stack is freed once this CPU has
+    // switched off it (see reap_process)
+    int32_t forked = pcb[sched_process].forked;
+    cli();
 	end_process(sched_process);
+
+    // Nobody waits in execute for a forked process, run whatever is next
+    if(forked){
+        if(tmnl_block[exec_terminal].active_process == sched_process){
+            tmnl_block[exec_terminal].active_process = prev_process;
+        }
+        int32_t next_pid = sched_pick();
+        if(next_pid == -1) change_context(-1, exec_terminal);
+        else change_context(next_pid, pcb[next_pid].terminal);
+    }
+
+    // Parent takes the halting process's place on the CPU
+    tmnl_block[exec_terminal].active_process = prev_process;
+    exec_process = prev_process;
+    pcb[prev_process].cpu = this_cpu()->id;
     
     // Restore Page Mapping
     create_process_page(prev_process);
     
     // Set esp0 in tss
-	tss.esp0 = OFF_8MB - PAGE_L - OFF_8KB*(prev_process);
+	this_cpu()->tss->esp0 = KSTACK_TOP(prev_process);
 
     // Return from iret
     asm volatile(
@@ -137,6 +162,7 @@ int32_t halt (uint8_t status){
 * Function: Executes given command
 */
 int32_t execute (const uint8_t* command){
+    uint32_t start = (uint32_t)rdtsc();
     if(command == NULL) return -1;
 
     // Retreive command
@@ -173,32 +199,27 @@ int32_t execute (const uint8_t* command){
     if(exec_buffer[0] != MAGIC_1 || exec_buffer[1] != MAGIC_2 || 
        exec_buffer[2] != MAGIC_3 || exec_buffer[3] != MAGIC_4) return -1;
 
-    // Create new process
+    // Create new process as a child of the caller, unless the scheduler
+    // already reserved this one for a base shell
     int32_t pid;
-    if(active_terminal == -1)
-    {
-        pid = create_process(-1);
-        active_terminal = 0;
+    int32_t parent = exec_process;
+    if(exec_process != -1 && pcb[exec_process].state == PROC_NEW){
+        pid = exec_process;
+        pcb[pid].state = PROC_READY;
     }
-    else
-    {
-        pid = create_process(tmnl_block[active_terminal].active_process);
+    else{
+        pid = create_process(exec_process);
     }
     if(pid == -1) return -1;
-
-    
-    // Designate if base terminal
-    if(pid == 0 || pid == 1 || pid == 2){
-        pcb[pid].parent = -1;
-        exec_terminal = pid;
-        tmnl_block[exec_terminal].active_process = pid;
-    }else{
-
-    // Set terminal child process to new pid, or to -1 if executing base shell
-    // must write if statement for initial boot of 3 shells
-        tmnl_block[active_terminal].active_process = pid;
+    if(active_terminal == -1){
+        active_terminal = exec_terminal;
+        remap_vidmem();
     }
 
+    // New process replaces its parent on the CPU until it halts
+    tmnl_block[exec_terminal].active_process = pid;
+    exec_process = pid;
+
     // Create process page
     create_process_page(pid);
 
@@ -208,9 +229,20 @@ int32_t execute (const uint8_t* command){
     read_data(exec_dentry.inode_num, ENTRY_OFF, entry_buf, 4);
     int32_t entry_point = (entry_buf[3] << 24) + (entry_buf[2] << 16) + (entry_buf[1] << 8) + entry_buf[0];  
 
-    // Load program into memory space 
-    ret = load_prog(exec_dentry.inode_num); //Program Loader
-    if(ret <= 0) return -1;
+    // Set up the program image, its pages are read in on first touch
+    ret = load_prog(pid, exec_dentry.inode_num); //Program Loader
+    if(ret <= 0){
+        // Empty image, or it does not fit below the user stack, hand the
+        // CPU back to the parent
+        if(pid != parent){
+            end_process(pid);
+            tmnl_block[exec_terminal].active_process = parent;
+            exec_process = parent;
+            if(parent != -1) create_process_page(parent);
+            else use_kernel_page_dir();
+        }
+        return -1;
+    }
 
     // Save stack and base pointers
     asm volatile("			        \n\
@@ -221,8 +253,17 @@ int32_t execute (const uint8_t* command){
     ); 
 
     // Perform context switch
-    tss.esp0 = OFF_8MB - 4 - OFF_8KB*(pid); 
-    tss.ss0 = KERNEL_DS;
+    this_cpu()->tss->esp0 = KSTACK_TOP(pid);
+    this_cpu()->tss->ss0 = KERNEL_DS;
+
+    // The iret below leaves the kernel without passing back through the
+    // syscall wrapper, so give up the kernel lock and start charging
+    // user time here
+    cli();
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    exec_cycles = exec_cycles - (exec_cycles >> 3) + (cycles >> 3);
+    acct_enter_user();
+    kernel_unlock_all();
 
     // Push registers for iret
     asm volatile ("             \n\
@@ -234,6 +275,9 @@ int32_t execute (const uint8_t* command){
             pushl %0            \n\
             iret                \n\
             halt_return:        \n\
+            pushl %%eax         \n\
+            call reap_process   \n\
+            popl %%eax          \n\
             leave               \n\
             ret                 \n\
             "
@@ -256,7 +300,7 @@ int32_t read (int32_t fd, void* buf, int32_t nbytes){
     if(buf == NULL) return -1;
 
     // Get currently scheduled process
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
     if(pcb[sched_process].fd_table[fd].flags == FD_ABSENT) return -1;
 
     // Jump to type-specific read
@@ -275,7 +319,7 @@ int32_t write (int32_t fd, const void* buf, int32_t nbytes){
     if(buf == NULL) return -1;
 
     // Get currently scheduled process
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
     if(pcb[sched_process].fd_table[fd].flags == FD_ABSENT) return -1;
 
     // Jump to type-specific write
@@ -300,10 +344,10 @@ int32_t open (const uint8_t* filename){
     if(fd == -1) return -1;
 
     // Get currently scheduled process
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
 
     // Jump to file-specific open
-    ret = ((pcb[sched_process].fd_table[fd].file_operations_table->open)(filename));
+    ret = ((pcb[sched_process].fd_table[fd].file_operations_table->open)(filename, fd));
     if(ret == -1) return -1;
 
     return fd;
@@ -319,7 +363,7 @@ int32_t close (int32_t fd){
     if(rem_fd(fd) == -1) return -1;
 
     // Get currently scheduled process
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
     //if(pcb[sched_process].fd_table[fd].flags == FD_ABSENT) return -1;
 
     return ((pcb[sched_process].fd_table[fd].file_operations_table->close)(fd));
@@ -337,10 +381,13 @@ int32_t getargs (uint8_t* buf, int32_t nbytes){
     if(nbytes > BUF_SIZE) nbytes = BUF_SIZE;
 
     // Get currently scheduled process
-    int32_t sched_process = tmnl_block[exec_terminal].active_process;
+    int32_t sched_process = exec_process;
 
-    // Fetch argument from parent
-    int par = pcb[sched_process].parent;
+    // Fetch argument from parent, forked processes share their parent's
+    int par = sched_process;
+    while(pcb[par].forked) par = pcb[par].parent;
+    par = pcb[par].parent;
+    if(par == -1) return -1;
     uint8_t* arg = pcb[par].argument;
     
     // Check for empty argument
@@ -363,8 +410,8 @@ int32_t getargs (uint8_t* buf, int32_t nbytes){
 * Function: maps the text-mode video memory
 */
 int32_t vidmap (uint8_t** screen_start){
-    // Check range (between 8MB and 12MB)
-    if(screen_start < (uint8_t**)(OFF_128MB) || screen_start >= (uint8_t**)(OFF_128MB + OFF_4MB - 4)){
+    // Check range (mapped in the program region)
+    if(!user_range_ok(exec_process, (uint32_t)screen_start, sizeof(*screen_start))){
         return -1;
     }
 
@@ -396,3 +443,144 @@ int32_t sigreturn (void){
 }
 
 
+/*int32_t set_tick(uint32_t hz)
+* Inputs: hz
+* Return value: 0 for success, -1 for failure
+* Function: sets the scheduler tick rate for the whole system
+*/
+int32_t set_tick (uint32_t hz){
+    return sched_set_tick(hz);
+}
+
+
+/*int32_t set_quantum(uint32_t ms)
+* Inputs: ms
+* Return value: 0 for success, -1 for failure
+* Function: sets the time slice of the calling process
+*/
+int32_t set_quantum (uint32_t ms){
+    return sched_set_quantum(exec_process, ms);
+}
+
+
+/*int32_t getclock(clock_info_t* buf)
+* Inputs: buf
+* Return value: 0 for success, -1 for failure
+* Function: reads the time since boot and the CPU time of the calling
+* process, in TSC cycles along with the cycles per millisecond
+*/
+int32_t getclock (clock_info_t* buf){
+    // Check range (mapped in the program region)
+    if(!user_range_ok(exec_process, (uint32_t)buf, sizeof(clock_info_t))){
+        return -1;
+    }
+    return clock_get(exec_process, buf);
+}
+
+
+/*int32_t sleep(uint32_t ms)
+* Inputs: ms
+* Return value: 0 for success, -1 for failure
+* Function: blocks the calling process for at least ms milliseconds
+*/
+int32_t sleep (uint32_t ms){
+    return sched_sleep(ms);
+}
+
+
+/*int32_t fork(void)
+* Inputs: none
+* Return value: pid of the child to the parent, 0 to the child, -1 for failure
+* Function: Duplicates the calling process. The child shares the parent's
+* pages copy-on-write, gets its own instance of each open file and starts
+* by returning from this call
+*/
+int32_t fork (void){
+    uint32_t start = (uint32_t)rdtsc();
+    int32_t parent = exec_process;
+    int i;
+
+    if(parent == -1) return -1;
+    int32_t pid = create_process(parent);
+    if(pid == -1) return -1;
+
+    // Same program and scheduling class as the parent
+    pb_t* child = &pcb[pid];
+    child->forked = 1;
+    child->terminal = pcb[parent].terminal;
+    child->image_inode = pcb[parent].image_inode;
+    child->image_len = pcb[parent].image_len;
+    child->image_end = pcb[parent].image_end;
+    child->image_rw = pcb[parent].image_rw;
+    child->brk = pcb[parent].brk;
+    child->mmap_base = pcb[parent].mmap_base;
+    memcpy(child->argument, pcb[parent].argument, ARG_SIZE);
+
+    if(fork_user_pages(parent, pid) == -1){
+        end_process(pid);
+        return -1;
+    }
+
+    // The child gets the parent's descriptors as they stand, positions
+    // included. RTC descriptors get a client of their own at the same rate
+    for(i=2; i < FDT_SIZE; i++){
+        if(pcb[parent].fd_table[i].flags != FD_EXISTS) continue;
+        child->fd_table[i] = pcb[parent].fd_table[i];
+        if(child->fd_table[i].file_operations_table != &rtc_fileops) continue;
+        child->fd_table[i].data = rtc_dup(pcb[parent].fd_table[i].data, pid);
+        if(child->fd_table[i].data == NULL) child->fd_table[i].flags = FD_ABSENT;
+    }
+
+    // The child returns to user space through a copy of the parent's
+    // system call frame, with 0 in eax (see fork_return)
+    memcpy((void*)(KSTACK_TOP(pid) - SYSCALL_FRAME), (void*)(KSTACK_TOP(parent) - SYSCALL_FRAME), SYSCALL_FRAME);
+    child->prev_sp = init_kernel_stack(KSTACK_TOP(pid) - SYSCALL_FRAME, fork_return);
+    sched_ready(pid);
+
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    fork_cycles = fork_cycles - (fork_cycles >> 3) + (cycles >> 3);
+    return pid;
+}
+
+
+/*int32_t mmap(int32_t fd, uint32_t* len)
+* Inputs: fd - open regular file
+*         len - bytes to map from its start, set to the bytes mapped
+* Return value: user address of the mapping, 0 (MMAP_FAILED) for failure
+* Function: Maps a file read-only into the caller's address space without
+* copying it (see map_file). The mapping lasts until the process halts
+*/
+int32_t mmap (int32_t fd, uint32_t* len){
+    int32_t pid = exec_process;
+
+    // Sanity checks
+    if(pid == -1 || fd < 2 || fd >= FDT_SIZE) return MMAP_FAILED;
+    if(pcb[pid].fd_table[fd].flags != FD_EXISTS) return MMAP_FAILED;
+    if(pcb[pid].fd_table[fd].file_operations_table != &file_fileops) return MMAP_FAILED;
+    if(!user_range_ok(pid, (uint32_t)len, sizeof(*len))) return MMAP_FAILED;
+
+    // Tell the caller how much of the file it got
+    uint32_t inode = pcb[pid].fd_table[fd].inode;
+    uint32_t want = *len;
+    if(want > inodes[inode].length) want = inodes[inode].length;
+
+    int32_t addr = map_file(pid, inode, want);
+    if(addr != MMAP_FAILED) *len = want;
+    return addr;
+}
+
+
+/*int32_t brk(uint32_t addr)
+* Inputs: addr - new end of the heap, 0 to query it
+* Return value: the current break, -1 for failure
+* Function: Grows or shrinks the caller's heap (see set_brk). User space
+* malloc carves its blocks out of it
+*/
+int32_t brk (uint32_t addr){
+    int32_t pid = exec_process;
+
+    if(pid == -1) return -1;
+    if(addr == 0) return pcb[pid].brk;
+
+    return set_brk(pid, addr);
+}
@@ -3,9 +3,18 @@
 
 #include "types.h"
 #include "paging.h"
+#include "clock.h"
 
 #define CMD_SIZE    32
 
+// Registers syscall_wrapper saves plus the iret frame, at the top of the
+// kernel stack
+#define SYSCALL_FRAME   52
+
+// mmap returns a user address, which is never 0 (the user region starts at
+// 128MB), so 0 rather than -1 reports failure
+#define MMAP_FAILED     0
+
 int32_t halt (uint8_t status);
 int32_t execute (const uint8_t* command);
 int32_t read (int32_t fd, void* buf, int32_t nbytes);
@@ -17,5 +26,16 @@ int32_t vidmap (uint8_t** screen_start);
 int32_t parse_cmd(const uint8_t* command, uint8_t buffer[CMD_SIZE]);
 int32_t set_handler (int32_t signum, void* handler_address);
 int32_t sigreturn (void);
+int32_t set_tick (uint32_t hz);
+int32_t set_quantum (uint32_t ms);
+int32_t getclock (clock_info_t* buf);
+int32_t sleep (uint32_t ms);
+int32_t fork (void);
+int32_t mmap (int32_t fd, uint32_t* len);
+int32_t brk (uint32_t addr);
+
+// Moving averages of the cycles spent in fork and in execute
+extern uint32_t fork_cycles;
+extern uint32_t exec_cycles;
 
 #endif /* _SYSCALL_H */
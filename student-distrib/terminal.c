@@ -5,13 +5,16 @@
 #include "PCB.h"
 #include "filesystem.h"
 
-// Extern declaration of terminal block and currently active terminal
-extern tmnl_t tmnl_block[NUM_TERMINAL];
-extern int active_terminal;
+// Terminal block and currently active terminal
+tmnl_t tmnl_block[NUM_TERMINAL];
+int active_terminal;
 
 // Array of attributes (text color) for each terminal
 static uint8_t tmnl_attrib[NUM_TERMINAL] = {ATTRIB_TERM1, ATTRIB_TERM2, ATTRIB_TERM3};
 
+// Processes sleeping in terminal_read, per terminal
+static pq_t tmnl_read_queue[NUM_TERMINAL];
+
 
 /* void init_terminal(tmnl_id);
  * Inputs: none
@@ -25,6 +28,7 @@ void init_terminal(){
         tmnl_block[i].enter_flag = KB_PENDING;
         tmnl_block[i].flags = TMNL_IDLE;
         tmnl_block[i].vidmem_ptr = (uint8_t*)(FOUR_KB*(VM_ADDR+i+1));
+        pq_init(&tmnl_read_queue[i]);
 
         // Clear terminal buffers
         int j;
@@ -205,6 +209,7 @@ int32_t switch_terminal(int tmnl_id){
     save_terminal(active_terminal);
     restore_terminal(tmnl_id);
     active_terminal = tmnl_id;
+    remap_vidmem();
 
     return 0;
 }
@@ -212,11 +217,11 @@ int32_t switch_terminal(int tmnl_id){
 
 
 
-/* int32_t terminal_open(const uint8_t* filename);
- * Inputs: filename
+/* int32_t terminal_open(const uint8_t* filename, int32_t fd);
+ * Inputs: filename, fd
  * Return Value: 0 for success, -1 for failure
  * Function: Opens an instance of the terminal */
-int32_t terminal_open (const uint8_t* filename){
+int32_t terminal_open (const uint8_t* filename, int32_t fd){
     return 0;
 }
 
@@ -240,12 +245,12 @@ int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes){
 
     // nbytes can always be 128 for safety, but must be less
     if(nbytes > BUF_SIZE) nbytes = BUF_SIZE;   
-    sti();
 
-    // Wait on enter 
-    while(tmnl_block[exec_terminal].enter_flag == KB_PENDING){}
+    // Sleep until the keyboard handler signals enter
+    while(tmnl_block[exec_terminal].enter_flag == KB_PENDING){
+        sched_block(&tmnl_read_queue[exec_terminal]);
+    }
 
-    cli();
     tmnl_block[exec_terminal].enter_flag = KB_PENDING;
     int i;
     for(i=0; i < nbytes; i++){
@@ -261,6 +266,15 @@ int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes){
 }
 
 
+/* void terminal_wake(int tmnl_id);
+ * Inputs: tmnl_id
+ * Return Value: none
+ * Function: Wakes processes waiting on a line of input from a terminal */
+void terminal_wake(int tmnl_id){
+    sched_wake(&tmnl_read_queue[tmnl_id]);
+}
+
+
 /* uint32_t terminal_write(int32_t fd, void* buf, int32_t nbytes);
  * Inputs: fd, buf, nbytes
  * Return Value: number of bytes written
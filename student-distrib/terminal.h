@@ -22,8 +22,9 @@ void init_terminal();
 void save_terminal(int tmnl_id);
 void restore_terminal(int tmnl_id);
 int32_t switch_terminal(int tmnl_id);
+void terminal_wake(int tmnl_id);
 
-int32_t terminal_open (const uint8_t* filename);
+int32_t terminal_open (const uint8_t* filename, int32_t fd);
 int32_t terminal_close (int32_t fd);
 int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t terminal_write(int32_t fd, const void* buf, int32_t nbytes);
@@ -43,7 +44,7 @@ typedef struct terminal {
 
 
 // Terminal block and currently active terminal
-tmnl_t tmnl_block[NUM_TERMINAL];
-int active_terminal;
+extern tmnl_t tmnl_block[NUM_TERMINAL];
+extern int active_terminal;
 
 #endif /* _TERMINAL_H */
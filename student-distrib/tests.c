@@ -6,11 +6,20 @@
 #include "PCB.h"
 #include "syscall.h"
 #include "terminal.h"
+#include "scheduler.h"
+#include "i8259.h"
+#include "as_wrapper.h"
+#include "paging.h"
+#include "clock.h"
+#include "timer.h"
+#include "frame.h"
+#include "slab.h"
+#include "set_idt.h"
 
 #define PASS 1
 #define FAIL 0
 
-extern pb_t pcb[PCB_SIZE];
+extern pb_t* pcb;
 
 /* format these macros as you see fit */
 #define TEST_HEADER 	\
@@ -42,6 +51,9 @@ int idt_test(){
 	int i;
 	int result = PASS;
 	for (i = 0; i < 10; ++i){
+		/* The double fault entry is a task gate, it has no offset */
+		if (i == DF_IDT && idt[i].seg_selector == DF_TSS)
+			continue;
 		if ((idt[i].offset_15_00 == NULL) && 
 			(idt[i].offset_31_16 == NULL)){
 			assertion_failure();
@@ -526,10 +538,1401 @@ void get_args_test(){
 /* Checkpoint 5 tests */
 
 
+/* Run queue test
+ * Pushes processes onto a queue, removes one
+ * from the middle and checks FIFO order
+ * Files: scheduler.c/h
+ */
+int run_queue_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	pq_t queue;
+	pq_init(&queue);
+
+	pq_push(&queue, 3);
+	pq_push(&queue, 4);
+	pq_push(&queue, 5);
+	pq_remove(&queue, 4);
+
+	if(queue.count != 2) result = FAIL;
+	if(pq_pop(&queue) != 3) result = FAIL;
+	if(pq_pop(&queue) != 5) result = FAIL;
+	if(pq_pop(&queue) != -1) result = FAIL;
+
+	return result;
+}
+
+/* Wait queue test
+ * Wakes two sleeping processes and checks they
+ * become runnable at the top level in FIFO order
+ * Files: scheduler.c/h
+ */
+int wait_queue_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	pq_t* run_queue = this_cpu()->run_queue;
+	pq_t wait_queue;
+	pq_init(&wait_queue);
+
+	pcb[3].cpu = this_cpu()->id;
+	pcb[4].cpu = this_cpu()->id;
+	pcb[3].state = PROC_BLOCKED;
+	pcb[4].state = PROC_BLOCKED;
+	pq_push(&wait_queue, 3);
+	pq_push(&wait_queue, 4);
+
+	pcb[3].level = SCHED_LEVELS - 1;
+	pcb[4].level = SCHED_LEVELS - 1;
+	int32_t queued = run_queue[0].count;
+	sched_wake(&wait_queue);
+
+	if(wait_queue.count != 0) result = FAIL;
+	if(pcb[3].state != PROC_READY || pcb[4].state != PROC_READY) result = FAIL;
+	if(pcb[3].level != 0 || pcb[4].level != 0) result = FAIL;
+	if(run_queue[0].count != queued + 2) result = FAIL;
+	if(run_queue[0].tail != 4 || pcb[4].q_prev != 3) result = FAIL;
+
+	pq_remove(&run_queue[0], 3);
+	pq_remove(&run_queue[0], 4);
+
+	return result;
+}
+
+/* Tick stop test
+ * Stops the tick as the idle task does and checks the timer
+ * interrupt is masked, then unmasked again on restart. That is
+ * IRQ0, or the CPU's own timer once local APIC timers drive
+ * preemption and the PIT stays masked
+ * Files: scheduler.c/h
+ */
+int tick_stop_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	int pit = !(inb(MASTER_8259_DATA) & (1 << IRQ_SCHED));
+
+	tick_stop();
+	if(pit && !(inb(MASTER_8259_DATA) & (1 << IRQ_SCHED))) result = FAIL;
+	if(!pit && !(lapic[LAPIC_LVT_TIMER >> 2] & LVT_MASKED)) result = FAIL;
+
+	tick_start();
+	if(pit && (inb(MASTER_8259_DATA) & (1 << IRQ_SCHED))) result = FAIL;
+	if(!pit && (lapic[LAPIC_LVT_TIMER >> 2] & LVT_MASKED)) result = FAIL;
+
+	return result;
+}
+
+/* MLFQ pick test
+ * Queues processes on different priority levels and
+ * checks the highest level is always picked first
+ * Files: scheduler.c/h
+ */
+int mlfq_pick_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	pq_t* run_queue = this_cpu()->run_queue;
+	int32_t runnable = sched_runnable();
+
+	pcb[3].cpu = this_cpu()->id;
+	pcb[4].cpu = this_cpu()->id;
+	pcb[5].cpu = this_cpu()->id;
+	pcb[3].level = SCHED_LEVELS - 1;
+	pcb[4].level = 0;
+	pcb[5].level = SCHED_LEVELS - 1;
+	sched_enqueue(3);
+	sched_enqueue(4);
+	sched_enqueue(5);
+
+	if(sched_runnable() != runnable + 3) result = FAIL;
+	if(runnable == 0){
+		// Picking dequeues them again
+		if(sched_pick() != 4) result = FAIL;
+		if(sched_pick() != 3) result = FAIL;
+		if(sched_pick() != 5) result = FAIL;
+	}
+	else{
+		pq_remove(&run_queue[0], 4);
+		pq_remove(&run_queue[SCHED_LEVELS - 1], 3);
+		pq_remove(&run_queue[SCHED_LEVELS - 1], 5);
+	}
+	pcb[3].level = 0;
+	pcb[5].level = 0;
+
+	return result;
+}
+
+/* Quantum test
+ * Checks set_quantum rejects pids without a
+ * process and slices out of range
+ * Files: scheduler.c/h
+ */
+int set_quantum_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	int32_t pid;
+	for(pid = 0; pid < num_pids; pid++){
+		if(pcb[pid].flags != PCB_EXISTS) break;
+	}
+
+	if(sched_set_quantum(-1, QUANTUM_MS) != -1) result = FAIL;
+	if(sched_set_quantum(num_pids, QUANTUM_MS) != -1) result = FAIL;
+	if(pid < num_pids && sched_set_quantum(pid, QUANTUM_MS) != -1) result = FAIL;
+
+	return result;
+}
+
+#define BENCH_ROUNDS		1000
+#define BENCH_STACK_SIZE	1024
+
+static uint32_t bench_stack[BENCH_STACK_SIZE];
+static uint32_t bench_main_sp;
+static uint32_t bench_peer_sp;
+
+// Saved esp/ebp pairs for the old-style switch
+static uint32_t legacy_main_save[2];
+static uint32_t legacy_peer_save[2];
+
+void legacy_peer(void);
+
+/* legacy_switch
+ * The switch change_context did before switch_to: only esp and ebp are
+ * swapped (eax = save area of the current context, edx = of the next one),
+ * everything else is spilled by the compiler around the call.
+ * legacy_peer bounces every switch straight back
+ */
+asm("legacy_switch:                        \n\
+        movl %esp, 0(%eax)                 \n\
+        movl %ebp, 4(%eax)                 \n\
+        movl 0(%edx), %esp                 \n\
+        movl 4(%edx), %ebp                 \n\
+        ret                                \n\
+    legacy_peer:                           \n\
+        movl $legacy_peer_save, %eax       \n\
+        movl $legacy_main_save, %edx       \n\
+        call legacy_switch                 \n\
+        jmp legacy_peer");
+
+/* bench_peer
+ * Peer context for switch_bench_test, bounces every switch straight back
+ */
+static void bench_peer(){
+	while(1){
+		switch_to(&bench_peer_sp, bench_main_sp);
+	}
+}
+
+/* switch_bench_test
+ * Ping-pongs the old esp/ebp swap and switch_to with a peer
+ * kernel stack and prints the average cost of one round trip
+ * (two switches) for each
+ * Files: as_wrapper.S, scheduler.c
+ */
+int switch_bench_test(){
+	TEST_HEADER;
+
+	int i;
+	uint64_t start;
+	uint32_t* peer_top = &bench_stack[BENCH_STACK_SIZE];
+
+	// Before: the peer starts by returning into legacy_peer
+	*(--peer_top) = (uint32_t)legacy_peer;
+	legacy_peer_save[0] = (uint32_t)peer_top;
+	legacy_peer_save[1] = 0;
+
+	start = rdtsc();
+	for(i=0; i < BENCH_ROUNDS; i++){
+		uint32_t save = (uint32_t)legacy_main_save;
+		uint32_t next = (uint32_t)legacy_peer_save;
+		asm volatile("call legacy_switch"
+			: "+a"(save), "+d"(next)
+			:
+			: "ebx", "ecx", "esi", "edi", "memory", "cc");
+	}
+	uint32_t legacy_cycles = (uint32_t)(rdtsc() - start);
+
+	// After: switch_to, reusing the same stack for a fresh peer
+	bench_peer_sp = init_kernel_stack((uint32_t)&bench_stack[BENCH_STACK_SIZE], bench_peer);
+
+	start = rdtsc();
+	for(i=0; i < BENCH_ROUNDS; i++){
+		switch_to(&bench_main_sp, bench_peer_sp);
+	}
+	uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+	printf("esp/ebp swap: %u cycles per round trip\n", legacy_cycles / BENCH_ROUNDS);
+	printf("switch_to: %u cycles per round trip\n", cycles / BENCH_ROUNDS);
+	return PASS;
+}
+
+#define FLUSH_SWITCHES		4
+
+/* TLB flush test
+ * Replays a few context switches between two processes and checks
+ * each costs at most one cr3 load, and none when the process keeps
+ * the CPU, where every switch used to reload cr3 twice
+ * Files: paging.c/h
+ */
+int tlb_flush_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	int i;
+	int32_t a = create_process(-1);
+	int32_t b = create_process(-1);
+	if(a == -1 || b == -1){
+		end_process(a);
+		end_process(b);
+		return FAIL;
+	}
+
+	// Switch to a, then b, stay on b, then back to a
+	int32_t pids[FLUSH_SWITCHES] = {a, b, b, a};
+	uint32_t flushes = tlb_flushes;
+	uint32_t invlpgs = tlb_invlpgs;
+	uint32_t skips = tlb_skips;
+
+	for(i = 0; i < FLUSH_SWITCHES; i++){
+		create_process_page(pids[i]);
+	}
+
+	flushes = tlb_flushes - flushes;
+	invlpgs = tlb_invlpgs - invlpgs;
+	skips = tlb_skips - skips;
+	printf("%d switches: %u flushes (was %d), %u invlpg, %u skipped\n",
+		FLUSH_SWITCHES, flushes, 2 * FLUSH_SWITCHES, invlpgs, skips);
+
+	if(flushes > FLUSH_SWITCHES - 1 || skips != 1) result = FAIL;
+
+	use_kernel_page_dir();
+	end_process(a);
+	end_process(b);
+	return result;
+}
+
+/* Global page test
+ * Checks PGE is on, the kernel page is global and
+ * the per-process program page is not
+ * Files: paging.c/h
+ */
+int global_page_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	uint32_t cr4;
+	asm volatile("movl %%cr4, %0" : "=r"(cr4));
+
+	if(!(cr4 & CR4_PGE)) result = FAIL;
+	if(!(page_directory[1] & PAGE_GLOBAL)) result = FAIL;
+
+	// Process directories copy the kernel entries
+	int32_t pid = create_process(-1);
+	if(pid == -1) return FAIL;
+	uint32_t* dir = (uint32_t*)pcb[pid].page_dir;
+	if(!(dir[1] & PAGE_GLOBAL)) result = FAIL;
+	if(dir[USER_PDE] & PAGE_GLOBAL) result = FAIL;
+	end_process(pid);
+
+	return result;
+}
+
+/* fault_in_syscall
+ * Stands in for a system call that page faults in the kernel.
+ * Takes the lock the call's entry would and saves its frame the
+ * way execute does, so halting pid returns from here
+ * Files: set_idt.c, syscall.c
+ */
+static int32_t __attribute__((noinline)) fault_in_syscall(int32_t pid){
+	asm volatile("movl %%ebp, %0; movl %%esp, %1"
+				 : "=r"(pcb[pid].base_ptr), "=r"(pcb[pid].stack_ptr));
+	kernel_lock();
+	exec_process = pid;
+	return *(volatile int32_t*)NULL;
+}
+
+
+/* syscall_fault_test
+ * Faults inside a system call of a child process and checks its
+ * halt leaves the kernel lock held once, for the call's return
+ * to drop, and that the child is gone. The lock the tests run
+ * under stands in for that level, so it is never released and
+ * the other CPUs stay parked
+ * Files: set_idt.c, smp.c
+ */
+int syscall_fault_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t held = cpu->lock_depth;
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	uint32_t saved_esp0 = cpu->tss->esp0;
+	int32_t saved_active = tmnl_block[0].active_process;
+	int32_t (*fn)(int32_t) = fault_in_syscall;
+	int result;
+	uint32_t flags;
+
+	cpu->terminal = 0;
+	int32_t parent = create_process(-1);
+	int32_t child = create_process(parent);
+	if(parent == -1 || child == -1){
+		if(parent != -1){
+			cpu->process = parent;
+			end_process(parent);
+		}
+		cpu->process = saved_process;
+		cpu->terminal = saved_terminal;
+		return FAIL;
+	}
+
+	// Only the level of the call itself is left to leave user mode with
+	cpu->lock_depth = 1;
+
+	// halt returns here through fault_in_syscall's frame, without
+	// restoring the callee saved registers gcc pushed there
+	cli_and_save(flags);
+	asm volatile("pushl %0    \n\
+				  call *%1    \n\
+				  addl $4, %%esp"
+				 :
+				 : "m"(child), "m"(fn)
+				 : "eax", "ebx", "ecx", "edx", "esi", "edi", "memory");
+	result = (cpu->lock_depth == 1 && pcb[child].flags == PCB_ABSENT) ? PASS : FAIL;
+
+	// end_process clears the fds of the running process
+	cpu->process = parent;
+	end_process(parent);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	cpu->tss->esp0 = saved_esp0;
+	cpu->lock_depth = held;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+/* APIC calibration test
+ * Calibrates the local APIC timer twice and checks both
+ * agree within 1/8, so the tick period is repeatable
+ * Files: smp.c/h
+ */
+int apic_calibrate_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	uint32_t first = lapic_timer_calibrate();
+	uint32_t second = lapic_timer_calibrate();
+
+	// Calibrating stops the timer, restart it if it drives preemption
+	sched_start_clock();
+
+	printf("%u, %u local APIC counts per ms\n", first, second);
+	if(lapic == NULL) return (first == 0 && second == 0) ? PASS : FAIL;
+
+	if(first == 0 || second == 0) result = FAIL;
+	if(first > second + (second >> 3) || second > first + (first >> 3)) result = FAIL;
+
+	return result;
+}
+
+
+/* clock_test
+ * Checks that the TSC was calibrated, that the clock moves forward
+ * and that getclock refuses a buffer outside the user page
+ * Files: clock.c, syscall.c
+ */
+int clock_test(){
+	TEST_HEADER;
+
+	clock_info_t info;
+	if(tsc_per_ms == 0) return FAIL;
+
+	uint64_t start = clock_cycles();
+	uint32_t start_ms = clock_ms();
+	while(clock_cycles() - start < (uint64_t)tsc_per_ms * 2);
+	if(clock_ms() - start_ms < 1) return FAIL;
+
+	if(getclock(&info) != -1) return FAIL;
+	return PASS;
+}
+
+
+#define WHEEL_TIMERS	1000
+
+static timer_t wheel_timers[WHEEL_TIMERS];
+static int32_t wheel_fired;
+
+/* wheel_fire
+ * Callback of the timers in timer_wheel_test
+ */
+static void wheel_fire(int32_t data){
+	wheel_fired += data;
+}
+
+/* timer_wheel_test
+ * Arms timers across every level of the wheel, cancels them all,
+ * then checks a due timer fires exactly once
+ * Files: timer.c
+ */
+int timer_wheel_test(){
+	TEST_HEADER;
+
+	int i;
+	uint32_t flags;
+	uint32_t before = timers_pending();
+	wheel_fired = 0;
+
+	for(i=0; i < WHEEL_TIMERS; i++){
+		timer_init(&wheel_timers[i], wheel_fire, 1);
+		timer_add(&wheel_timers[i], 1000 + (uint32_t)i * i * 37);
+	}
+	if(timers_pending() != before + WHEEL_TIMERS) return FAIL;
+
+	for(i=0; i < WHEEL_TIMERS; i++){
+		if(timer_cancel(&wheel_timers[i]) != 1) return FAIL;
+	}
+	if(timers_pending() != before || timer_cancel(&wheel_timers[0]) != 0) return FAIL;
+
+	cli_and_save(flags);
+	timer_add(&wheel_timers[0], 0);
+	timer_run();
+	timer_run();
+	restore_flags(flags);
+
+	if(wheel_fired != 1 || timer_pending(&wheel_timers[0])) return FAIL;
+	return PASS;
+}
+
+/* Virtual RTC test
+ * Opens two RTC descriptors at different rates and checks each
+ * ticks on its own schedule, and that ending the process frees
+ * a descriptor it never closed
+ * Files: rtc_handler.c/h, PCB.c
+ */
+int rtc_virtual_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	uint32_t fast_hz = HZ_512;
+	int i;
+
+	int32_t pid = create_process(-1);
+	if(pid == -1) return FAIL;
+	cpu->process = pid;
+
+	// The open system call fills in the descriptors before rtc_open
+	for(i = 2; i <= 3; i++){
+		pcb[pid].fd_table[i].file_operations_table = &rtc_fileops;
+		pcb[pid].fd_table[i].flags = FD_EXISTS;
+	}
+
+	// Interrupts are off, so the handler only runs when called here
+	if(rtc_open(NULL, 2) != 0 || rtc_open(NULL, 3) != 0){
+		end_process(pid);
+		cpu->process = saved_process;
+		return FAIL;
+	}
+	rtcc_t* slow = pcb[pid].fd_table[2].data;
+	rtcc_t* fast = pcb[pid].fd_table[3].data;
+	if(rtc_write(3, &fast_hz, sizeof(fast_hz)) == -1) result = FAIL;
+
+	for(i = 0; i < RTC_R2; i++) rtc_handler();
+	if(fast->flags != RTC_TICK || slow->flags != RTC_WAIT) result = FAIL;
+
+	// A pending tick is consumed without sleeping
+	if(rtc_read(3, NULL, 0) != 0 || fast->flags != RTC_WAIT) result = FAIL;
+
+	for(; i < RTC_R512; i++) rtc_handler();
+	if(slow->flags != RTC_TICK) result = FAIL;
+
+	rtc_close(3);
+	if(pcb[pid].fd_table[3].data != NULL) result = FAIL;
+
+	// fd 2 is left open for end_process to release, the last client
+	// leaving masks IRQ8
+	end_process(pid);
+	if(pcb[pid].fd_table != NULL) result = FAIL;
+	if(!(inb(SLAVE_8259_DATA) & (1 << (IRQ8 - 8)))) result = FAIL;
+
+	cpu->process = saved_process;
+	return result;
+}
+
+/* rtc_rate_reg
+ * Reads the rate bits of RTC register A
+ */
+static uint8_t rtc_rate_reg(){
+	outb(REG_NMI | REGA, RTC_PORT);
+	return inb(CMOS_PORT) & ~RATE_MASK;
+}
+
+
+/* Adaptive RTC rate test
+ * Opens a 2 Hz and a 512 Hz client and checks the hardware
+ * follows the fastest one, then masks IRQ8 once both close
+ * Files: rtc_handler.c/h
+ */
+int rtc_adaptive_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	uint32_t fast_hz = HZ_512;
+	int i;
+
+	int32_t pid = create_process(-1);
+	if(pid == -1) return FAIL;
+	cpu->process = pid;
+	for(i = 2; i <= 3; i++){
+		pcb[pid].fd_table[i].file_operations_table = &rtc_fileops;
+		pcb[pid].fd_table[i].flags = FD_EXISTS;
+	}
+
+	// 2 Hz is a period of 512 interrupts at HZ_1024, log2 of which is 9
+	if(rtc_open(NULL, 2) != 0) result = FAIL;
+	if(rtc_rate_reg() != RATE_MAX + 9) result = FAIL;
+	if(inb(SLAVE_8259_DATA) & (1 << (IRQ8 - 8))) result = FAIL;
+
+	// 512 Hz is a period of 2
+	if(rtc_open(NULL, 3) != 0) result = FAIL;
+	if(rtc_write(3, &fast_hz, sizeof(fast_hz)) == -1) result = FAIL;
+	if(rtc_rate_reg() != RATE_MAX + 1) result = FAIL;
+
+	rtc_close(3);
+	if(rtc_rate_reg() != RATE_MAX + 9) result = FAIL;
+
+	rtc_close(2);
+	if(!(inb(SLAVE_8259_DATA) & (1 << (IRQ8 - 8)))) result = FAIL;
+
+	end_process(pid);
+	cpu->process = saved_process;
+	return result;
+}
+
+
+/* frame_alloc_test
+ * Allocates a kernel frame and an aligned 4MB block,
+ * checks where they landed and that freeing restores the count
+ * Files: frame.c
+ */
+int frame_alloc_test(){
+	TEST_HEADER;
+
+	uint32_t before = frames_free();
+	uint32_t low = alloc_frames(1, 1, FRAME_LOW);
+	uint32_t big = alloc_frames(FRAMES_4MB, FRAMES_4MB, 0);
+
+	if(low == 0 || low < OFF_8MB || low >= lowmem_end) return FAIL;
+	if(big == 0 || (big & (OFF_4MB - 1)) != 0) return FAIL;
+	if(frames_free() != before - 1 - FRAMES_4MB) return FAIL;
+
+	free_frames(low, 1);
+	free_frames(big, FRAMES_4MB);
+	if(frames_free() != before) return FAIL;
+	return PASS;
+}
+
+
+/* Memory report test
+ * Loads hello into a new process and touches its image and
+ * stack, then checks it holds only the pages those need, that
+ * the free count drops by exactly those, and that ending it
+ * gives them all back. Prints the memory report with the
+ * process in it
+ * Files: paging.c, PCB.c
+ */
+int mem_report_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t start = frames_free();
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t pid = create_process(-1);
+	if(pid == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = pid;
+	create_process_page(pid);
+
+	uint32_t before = frames_free();
+	uint32_t shared = fs_mapped_pages;
+	uint32_t image = (inodes[dentry.inode_num].length + FOUR_KB - 1) / FOUR_KB;
+	if(load_prog(pid, dentry.inode_num) <= 0) result = FAIL;
+	uint32_t addr;
+	for(addr = (uint32_t)program_start; addr < pcb[pid].image_end; addr += FOUR_KB) *(volatile uint8_t*)addr;
+	for(addr = USER_STACK_BOTTOM; addr < OFF_128MB + OFF_4MB; addr += FOUR_KB) *(volatile uint8_t*)addr;
+
+	// The image (plus bss) and the stack, nowhere near a 4MB page.
+	// Pages shared with the filesystem image hold no frame
+	uint32_t pages = pcb[pid].user_pages + fs_mapped_pages - shared;
+	if(pages < image + USER_STACK_PAGES || pages > image + USER_STACK_PAGES + 2) result = FAIL;
+	if(frames_free() != before - pcb[pid].user_pages) result = FAIL;
+	print_mem_stats();
+
+	end_process(pid);
+	if(frames_free() != start) result = FAIL;
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Demand paging test
+ * Loads hello without reading it, then touches the first image
+ * page and the top stack page. Each fault maps one page, the
+ * image page holds the start of the file, the stack page is
+ * zeroed, and the gap between them stays invalid
+ * Files: paging.c, set_idt.c, as_wrapper.S
+ */
+int demand_page_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t faults = demand_faults;
+	uint32_t shared = fs_mapped_pages;
+	int result = PASS;
+	dentry_t dentry;
+	uint8_t head[ELF_EHDR_SIZE];
+	uint32_t flags;
+	int i;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+	if(read_data(dentry.inode_num, 0, head, ELF_EHDR_SIZE) != ELF_EHDR_SIZE) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t pid = create_process(-1);
+	if(pid == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = pid;
+	create_process_page(pid);
+
+	// Nothing is read or mapped up front
+	if(load_prog(pid, dentry.inode_num) <= 0) result = FAIL;
+	if(pcb[pid].user_pages != 0) result = FAIL;
+
+	for(i=0; i < ELF_EHDR_SIZE; i++){
+		if(program_start[i] != head[i]) result = FAIL;
+	}
+	uint32_t* top = (uint32_t*)(OFF_128MB + OFF_4MB - 4);
+	if(*top != 0) result = FAIL;
+
+	if(demand_faults - faults != 2 || pcb[pid].user_pages + fs_mapped_pages - shared != 2) result = FAIL;
+	if(user_page_valid(pid, USER_STACK_BOTTOM - FOUR_KB)) result = FAIL;
+	if(!user_page_valid(pid, USER_STACK_BOTTOM)) result = FAIL;
+
+	end_process(pid);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Filesystem page test
+ * Touches the first page of hello, which is filled entirely from
+ * one data block. With an aligned filesystem image it maps that
+ * block read-only and takes no frame. Then the page is treated as
+ * writable and written: the write fault copies the block into a
+ * private frame and the filesystem image is left unchanged
+ * Files: paging.c, set_idt.c
+ */
+int fs_page_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t shared = fs_mapped_pages;
+	uint32_t copies = cow_copies;
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+	uint8_t* block = data_blocks[inodes[dentry.inode_num].inode_data[0]].data_entry;
+	uint8_t first = block[0];
+	uint8_t last = block[FOUR_KB - 1];
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t pid = create_process(-1);
+	if(pid == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = pid;
+	create_process_page(pid);
+	if(load_prog(pid, dentry.inode_num) <= 0) result = FAIL;
+
+	uint32_t* pte = &((uint32_t*)pcb[pid].page_table)[((uint32_t)program_start - OFF_128MB) / FOUR_KB];
+	uint32_t before = frames_free();
+	if(program_start[FOUR_KB - 1] != last) result = FAIL;
+
+	if(!((uint32_t)block & (FOUR_KB-1))){
+		// The CPU sets the accessed bit, so check the fields we wrote
+		if((*pte & ~(FOUR_KB-1)) != (uint32_t)block || (*pte & (PAGE_USER | PAGE_FS)) != (PAGE_USER_RO | PAGE_FS)) result = FAIL;
+		if(fs_mapped_pages - shared != 1 || frames_free() != before) result = FAIL;
+
+		// Text pages are never copied
+		if(copy_on_write(pid, (uint32_t)program_start) != -1) result = FAIL;
+
+		// Treat the page as part of a writable segment
+		pcb[pid].image_rw = (uint32_t)program_start;
+		program_start[0] = first + 1;
+		if(cow_copies - copies != 1 || frames_free() != before - 1) result = FAIL;
+		if(*pte & PAGE_FS) result = FAIL;
+		if(program_start[FOUR_KB - 1] != last || block[0] != first) result = FAIL;
+	}
+
+	end_process(pid);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Fork test
+ * Forks a process with a written stack page and an RTC open at
+ * 8Hz. Both share the page read-only until the child writes it,
+ * which copies it: the child reads its new value and the parent
+ * still reads the old one. The parent's own write then takes the
+ * frame over without a copy, and the child's RTC ticks at 8Hz
+ * Files: syscall.c, paging.c, frame.c, rtc_handler.c
+ */
+int fork_cow_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t copies = cow_copies;
+	uint32_t reuses = cow_reuses;
+	uint32_t freq = HZ_8;
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t parent = create_process(-1);
+	if(parent == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = parent;
+	create_process_page(parent);
+	if(load_prog(parent, dentry.inode_num) <= 0) result = FAIL;
+
+	volatile uint32_t* top = (uint32_t*)(OFF_128MB + OFF_4MB - 4);
+	uint32_t idx = ((uint32_t)top - OFF_128MB) / FOUR_KB;
+	*top = 0x1234;
+
+	pcb[parent].fd_table[2].file_operations_table = &rtc_fileops;
+	pcb[parent].fd_table[2].flags = FD_EXISTS;
+	if(rtc_open(NULL, 2) == -1 || rtc_write(2, &freq, sizeof(freq)) == -1) result = FAIL;
+
+	int32_t child = fork();
+	if(child <= 0){
+		end_process(parent);
+		cpu->process = saved_process;
+		cpu->terminal = saved_terminal;
+		tmnl_block[0].active_process = saved_active;
+		if(saved_process != -1) create_process_page(saved_process);
+		else use_kernel_page_dir();
+		restore_flags(flags);
+		return FAIL;
+	}
+
+	// Nothing runs the child, it only owns pages and descriptors
+	pq_remove(&cpus[pcb[child].cpu].run_queue[pcb[child].level], child);
+
+	uint32_t* ptab = (uint32_t*)pcb[parent].page_table;
+	uint32_t* ctab = (uint32_t*)pcb[child].page_table;
+	if((ptab[idx] & ~(FOUR_KB-1)) != (ctab[idx] & ~(FOUR_KB-1))) result = FAIL;
+	if((ptab[idx] & (PAGE_RW | PAGE_COW)) != PAGE_COW || (ctab[idx] & (PAGE_RW | PAGE_COW)) != PAGE_COW) result = FAIL;
+	if(pcb[child].fd_table[2].flags != FD_EXISTS) result = FAIL;
+	rtcc_t* dup = pcb[child].fd_table[2].data;
+	if(dup == NULL || dup == pcb[parent].fd_table[2].data || dup->client != child || dup->rate != RTC_R128) result = FAIL;
+
+	cpu->process = child;
+	create_process_page(child);
+	if(*top != 0x1234) result = FAIL;
+	*top = 0x5678;
+	if(*top != 0x5678 || cow_copies - copies != 1) result = FAIL;
+
+	cpu->process = parent;
+	create_process_page(parent);
+	if(*top != 0x1234) result = FAIL;
+	*top = 0x9abc;
+	if(cow_reuses - reuses != 1 || cow_copies - copies != 1) result = FAIL;
+
+	end_process(child);
+	end_process(parent);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* slab_test
+ * Allocates objects of a few size classes and a large block,
+ * checks they are distinct, aligned and that freeing them
+ * gives every frame back
+ * Files: slab.c
+ */
+int slab_test(){
+	TEST_HEADER;
+
+	uint32_t before = frames_free();
+	uint8_t* a = kmalloc(24);
+	uint8_t* b = kmalloc(24);
+	uint8_t* c = kzalloc(SLAB_MAX);
+	uint8_t* big = kmalloc(3 * FRAME_SIZE);
+
+	if(a == NULL || b == NULL || c == NULL || big == NULL) return FAIL;
+	if(a == b || ((uint32_t)a & (SLAB_MIN - 1)) != 0) return FAIL;
+	if(c[0] != 0 || c[SLAB_MAX - 1] != 0) return FAIL;
+	big[3 * FRAME_SIZE - 1] = 1;
+
+	kfree(a);
+	if(kmalloc(24) != a) return FAIL;
+	kfree(a);
+	kfree(b);
+	kfree(c);
+	kfree(big);
+	kfree(NULL);
+	if(frames_free() != before) return FAIL;
+	return PASS;
+}
+
+
+/* Text cache test
+ * Runs two instances of hello as if their whole image were
+ * read-only, so the partial last page goes through the text
+ * cache. The first fault loads it, the second maps the same
+ * frame, and the page leaves the cache with its last process
+ * Files: paging.c
+ */
+int text_cache_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t start = frames_free();
+	uint32_t cached = text_pages;
+	uint32_t hits = text_hits;
+	int32_t pid[2];
+	uint32_t pte[2];
+	static uint8_t tail[FOUR_KB];
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+	uint32_t j;
+	int i;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+	uint32_t len = inodes[dentry.inode_num].length;
+	if(len <= FOUR_KB || len >= 2 * FOUR_KB) return FAIL;
+	if(read_data(dentry.inode_num, FOUR_KB, tail, len - FOUR_KB) != len - FOUR_KB) return FAIL;
+
+	uint8_t* page = program_start + FOUR_KB;
+	uint32_t idx = ((uint32_t)page - OFF_128MB) / FOUR_KB;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	for(i=0; i < 2; i++){
+		pid[i] = create_process(-1);
+		if(pid[i] == -1){
+			if(i == 1) end_process(pid[0]);
+			cpu->process = saved_process;
+			cpu->terminal = saved_terminal;
+			tmnl_block[0].active_process = saved_active;
+			if(saved_process != -1) create_process_page(saved_process);
+			else use_kernel_page_dir();
+			restore_flags(flags);
+			return FAIL;
+		}
+		cpu->process = pid[i];
+		create_process_page(pid[i]);
+		if(load_prog(pid[i], dentry.inode_num) <= 0) result = FAIL;
+		pcb[pid[i]].image_rw = USER_STACK_BOTTOM;
+
+		for(j=0; j < len - FOUR_KB; j++){
+			if(page[j] != tail[j]) result = FAIL;
+		}
+		if(page[len - FOUR_KB] != 0) result = FAIL;
+		pte[i] = ((uint32_t*)pcb[pid[i]].page_table)[idx];
+		if(!(pte[i] & PAGE_TEXT) || (pte[i] & PAGE_RW)) result = FAIL;
+	}
+
+	if((pte[0] & ~(FOUR_KB-1)) != (pte[1] & ~(FOUR_KB-1))) result = FAIL;
+	if(text_pages - cached != 1 || text_hits - hits != 1) result = FAIL;
+
+	end_process(pid[0]);
+	if(text_pages - cached != 1) result = FAIL;
+	end_process(pid[1]);
+	if(text_pages != cached || frames_free() != start) result = FAIL;
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Page directory test
+ * Two processes get directories of their own that share the
+ * kernel entries and point the program PDE at their own table.
+ * Ending one frees its directory and table
+ * Files: paging.c, PCB.c
+ */
+int page_dir_test(){
+	TEST_HEADER;
+
+	int result = PASS;
+	uint32_t start = frames_free();
+	int32_t a = create_process(-1);
+	int32_t b = create_process(-1);
+	if(a == -1 || b == -1){
+		end_process(a);
+		end_process(b);
+		return FAIL;
+	}
+
+	uint32_t* dir_a = (uint32_t*)pcb[a].page_dir;
+	uint32_t* dir_b = (uint32_t*)pcb[b].page_dir;
+	if(dir_a == dir_b) result = FAIL;
+	if(dir_a[1] != page_directory[1] || dir_b[1] != page_directory[1]) result = FAIL;
+	if(dir_a[USER_PDE] != (pcb[a].page_table | PAGE_USER)) result = FAIL;
+	if(dir_b[USER_PDE] != (pcb[b].page_table | PAGE_USER)) result = FAIL;
+
+	end_process(a);
+	end_process(b);
+	if(frames_free() != start) result = FAIL;
+	return result;
+}
+
+
+/* Fork TLB test
+ * The parent writes its stack page, so the TLB holds a writable
+ * entry for it, then forks while its directory is loaded. Its
+ * next write must fault and copy the page instead of going
+ * through to the frame the child shares. Fork invalidates only
+ * the pages it write-protected and never reloads cr3
+ * Files: paging.c, syscall.c
+ */
+int fork_tlb_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t copies = cow_copies;
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t parent = create_process(-1);
+	if(parent == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = parent;
+	create_process_page(parent);
+	if(load_prog(parent, dentry.inode_num) <= 0) result = FAIL;
+
+	volatile uint32_t* top = (uint32_t*)(OFF_128MB + OFF_4MB - 4);
+	*top = 0x1234;
+	uint32_t writable = pcb[parent].user_pages;
+
+	uint32_t flushes = tlb_flushes;
+	uint32_t invlpgs = tlb_invlpgs;
+	int32_t child = fork();
+	if(child > 0){
+		pq_remove(&cpus[pcb[child].cpu].run_queue[pcb[child].level], child);
+		// Mapping the child's kernel stack invalidates its pages too
+		if(tlb_flushes != flushes || tlb_invlpgs - invlpgs != writable + KSTACK_PAGES) result = FAIL;
+
+		// Still on the parent's directory
+		*top = 0x5678;
+		if(cow_copies - copies != 1) result = FAIL;
+
+		cpu->process = child;
+		create_process_page(child);
+		if(*top != 0x1234) result = FAIL;
+		end_process(child);
+	}
+	else result = FAIL;
+
+	cpu->process = parent;
+	end_process(parent);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Mmap test
+ * Maps a program file several pages long and checks every byte
+ * against what read returns for the same file. The mapping is
+ * read-only. A mapping that does not fit, or runs out of memory
+ * partway, fails with MMAP_FAILED and leaves nothing mapped
+ * Files: paging.c, syscall.c
+ */
+int mmap_test(){
+	TEST_HEADER;
+
+	static uint8_t buf[FOUR_KB];
+	static uint32_t held[256][2];
+	int32_t n = 0;
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	uint32_t mapped = mmap_direct + mmap_copied;
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+	uint32_t i;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t pid = create_process(-1);
+	if(pid == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = pid;
+	create_process_page(pid);
+	if(load_prog(pid, dentry.inode_num) <= 0) result = FAIL;
+
+	// The length goes through user memory, like a program's would
+	uint32_t* len = (uint32_t*)(OFF_128MB + OFF_4MB - 4);
+	int32_t fd = open((uint8_t*)"fish");
+	uint32_t base = pcb[pid].mmap_base;
+	*len = 0xFFFFFFFF;
+	uint8_t* map = (uint8_t*)mmap(fd, len);
+	if(fd == -1 || map == (uint8_t*)MMAP_FAILED) result = FAIL;
+	else{
+		uint32_t pages = (*len + FOUR_KB - 1) / FOUR_KB;
+		if(*len <= FOUR_KB || (uint32_t)map != base - pages * FOUR_KB) result = FAIL;
+		if(mmap_direct + mmap_copied - mapped != pages) result = FAIL;
+
+		int32_t cnt;
+		uint32_t offset = 0;
+		while((cnt = read(fd, buf, FOUR_KB)) > 0){
+			for(i=0; i < cnt; i++){
+				if(map[offset + i] != buf[i]) result = FAIL;
+			}
+			offset += cnt;
+		}
+		if(offset != *len) result = FAIL;
+
+		// File mappings are never copied on write
+		for(i=0; i < pages; i++){
+			if(copy_on_write(pid, (uint32_t)map + i * FOUR_KB) != -1) result = FAIL;
+		}
+
+		// Leave room for one page only
+		uint32_t image_top = (pcb[pid].image_end + FOUR_KB - 1) & ~(FOUR_KB-1);
+		pcb[pid].mmap_base = image_top + FOUR_KB;
+		uint32_t before = frames_free();
+		*len = 0xFFFFFFFF;
+		if(mmap(fd, len) != MMAP_FAILED) result = FAIL;
+		if(pcb[pid].mmap_base != image_top + FOUR_KB || frames_free() != before) result = FAIL;
+
+		// Take every free frame so the copy of the partial last page fails
+		pcb[pid].mmap_base = base = (uint32_t)map;
+		uint32_t count;
+		for(count = FRAMES_4MB; count > 0; count >>= 2){
+			while(n < 256 && (held[n][0] = alloc_frames(count, 1, 0)) != 0) held[n++][1] = count;
+		}
+		if(frames_free() != 0) result = FAIL;
+
+		*len = 0xFFFFFFFF;
+		uint32_t* table = (uint32_t*)pcb[pid].page_table;
+		if(mmap(fd, len) != MMAP_FAILED || pcb[pid].mmap_base != base) result = FAIL;
+		for(i=0; i < pages; i++){
+			if(table[(base - (i + 1) * FOUR_KB - OFF_128MB) / FOUR_KB] != 0) result = FAIL;
+		}
+		while(n > 0){
+			n--;
+			free_frames(held[n][0], held[n][1]);
+		}
+	}
+
+	end_process(pid);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Brk test
+ * Grows the heap three pages past the image, touches them so
+ * they fault in zeroed, then shrinks it back, which must free
+ * them at once. The break cannot drop into the image or reach
+ * past the lowest file mapping, and mmap stays above the heap
+ * Files: paging.c, syscall.c
+ */
+int brk_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	int32_t saved_process = cpu->process;
+	int saved_terminal = cpu->terminal;
+	int32_t saved_active = tmnl_block[0].active_process;
+	int result = PASS;
+	dentry_t dentry;
+	uint32_t flags;
+	uint32_t i;
+
+	if(read_dentry_by_name((uint8_t*)"hello", &dentry) == -1) return FAIL;
+
+	cli_and_save(flags);
+	cpu->terminal = 0;
+	int32_t pid = create_process(-1);
+	if(pid == -1){
+		cpu->terminal = saved_terminal;
+		restore_flags(flags);
+		return FAIL;
+	}
+	cpu->process = pid;
+	create_process_page(pid);
+	if(load_prog(pid, dentry.inode_num) <= 0) result = FAIL;
+
+	uint32_t start = brk(0);
+	uint32_t heap = (start + FOUR_KB - 1) & ~(FOUR_KB-1);
+	if(start < pcb[pid].image_end) result = FAIL;
+
+	// Touch the image's last page first so only heap pages are counted
+	*(volatile uint8_t*)(pcb[pid].image_end - 1);
+	uint32_t pages = pcb[pid].user_pages;
+	uint32_t before = frames_free();
+
+	if(brk(heap + 3 * FOUR_KB) != heap + 3 * FOUR_KB) result = FAIL;
+	for(i=0; i < 3; i++){
+		volatile uint32_t* word = (uint32_t*)(heap + i * FOUR_KB);
+		if(*word != 0) result = FAIL;
+		*word = i + 1;
+	}
+	if(pcb[pid].user_pages - pages != 3 || before - frames_free() != 3) result = FAIL;
+
+	// Shrinking frees the pages above the new break
+	if(brk(start) != start) result = FAIL;
+	if(pcb[pid].user_pages != pages || frames_free() != before) result = FAIL;
+	uint32_t* table = (uint32_t*)pcb[pid].page_table;
+	for(i=0; i < 3; i++){
+		if(table[(heap + i * FOUR_KB - OFF_128MB) / FOUR_KB] != 0) result = FAIL;
+	}
+
+	if(brk(pcb[pid].image_end - 1) != -1) result = FAIL;
+	if(brk(pcb[pid].mmap_base + 1) != -1) result = FAIL;
+	if(brk(0) != start) result = FAIL;
+
+	// A heap that reaches the mappings leaves mmap no room
+	int32_t fd = open((uint8_t*)"frame0.txt");
+	uint32_t* len = (uint32_t*)(OFF_128MB + OFF_4MB - 4);
+	if(brk(pcb[pid].mmap_base) != pcb[pid].mmap_base) result = FAIL;
+	*len = FOUR_KB;
+	if(fd == -1 || mmap(fd, len) != MMAP_FAILED) result = FAIL;
+	brk(start);
+
+	end_process(pid);
+
+	cpu->process = saved_process;
+	cpu->terminal = saved_terminal;
+	tmnl_block[0].active_process = saved_active;
+	if(saved_process != -1) create_process_page(saved_process);
+	else use_kernel_page_dir();
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Kernel stack test
+ * Maps the kernel stack of the last pid, writes both ends of
+ * it and checks only the page below counts as its guard, then
+ * that unmapping gives every frame back
+ * Files: paging.c
+ */
+int kstack_test(){
+	TEST_HEADER;
+
+	int32_t pid = num_pids - 1;
+	if(pcb[pid].flags == PCB_EXISTS) return FAIL;
+
+	uint32_t before = frames_free();
+	uint8_t* stack = (uint8_t*)map_kstack(pid);
+	if(stack == NULL) return FAIL;
+
+	stack[0] = 1;
+	stack[KSTACK_SIZE - 1] = 1;
+	if(kstack_guard_pid((uint32_t)stack - 1) != pid) return FAIL;
+	if(kstack_guard_pid((uint32_t)stack - FOUR_KB) != pid) return FAIL;
+	if(kstack_guard_pid((uint32_t)stack) != -1) return FAIL;
+	if(kstack_guard_pid((uint32_t)stack + KSTACK_SIZE - 1) != -1) return FAIL;
+
+	unmap_kstack(pid);
+	if(frames_free() != before) return FAIL;
+	return PASS;
+}
+
+
+static int32_t reap_pid;
+static uint32_t reap_main_sp;
+static uint32_t reap_peer_sp;
+
+/* reap_peer
+ * Runs on reap_pid's own kernel stack and ends it from there,
+ * the way halt does, then switches back for good
+ */
+static void reap_peer(){
+	end_process(reap_pid);
+	switch_to(&reap_peer_sp, reap_main_sp);
+}
+
+
+/* Kernel stack reap test
+ * A process ending itself on its own kernel stack keeps the
+ * stack and its pid until the CPU is off it. reap_process then
+ * frees both
+ * Files: PCB.c, paging.c
+ */
+int kstack_reap_test(){
+	TEST_HEADER;
+
+	cpu_t* cpu = this_cpu();
+	uint32_t before = frames_free();
+	int result = PASS;
+	uint32_t flags;
+
+	cli_and_save(flags);
+	reap_pid = create_process(-1);
+	if(reap_pid == -1){
+		restore_flags(flags);
+		return FAIL;
+	}
+
+	reap_peer_sp = init_kernel_stack(pcb[reap_pid].kstack + KSTACK_SIZE, reap_peer);
+	switch_to(&reap_main_sp, reap_peer_sp);
+	if(pcb[reap_pid].flags != PCB_DEAD || cpu->reap != reap_pid) result = FAIL;
+
+	reap_process();
+	if(pcb[reap_pid].flags != PCB_ABSENT || cpu->reap != -1) result = FAIL;
+	if(frames_free() != before) result = FAIL;
+
+	restore_flags(flags);
+	return result;
+}
+
+
+/* Double fault task test
+ * Each CPU's double fault task has a TSS descriptor of its own
+ * pointing at its cpu_t, and a stack no other CPU's task uses.
+ * The boot CPU's IDT gate names CPU 0's task
+ * Files: set_idt.c, smp.c, x86_desc.S
+ */
+int df_task_test(){
+	TEST_HEADER;
+
+	int i, j;
+	for(i=0; i < MAX_CPUS; i++){
+		seg_desc_t* desc = &df_tss_desc_ptr[i];
+		uint32_t base = desc->base_15_00 | (desc->base_23_16 << 16) | (desc->base_31_24 << 24);
+		if(base != (uint32_t)&cpus[i].df_tss) return FAIL;
+		if(cpus[i].df_tss.eip == 0) return FAIL;
+		for(j=0; j < i; j++){
+			if(cpus[i].df_tss.esp - cpus[j].df_tss.esp < DF_STACK_SIZE) return FAIL;
+			if(cpus[j].df_tss.esp - cpus[i].df_tss.esp < DF_STACK_SIZE) return FAIL;
+		}
+	}
+	if(idt[DF_IDT].seg_selector != DF_TSS) return FAIL;
+	return PASS;
+}
+
+
 /* Test suite entry point */
 void launch_tests(){
 	//clear();
-	//TEST_OUTPUT("idt_test", idt_test());
+	TEST_OUTPUT("idt_test", idt_test());
 	
 	// launch your tests here
 
@@ -550,6 +1953,34 @@ void launch_tests(){
 	//dir_read_test();
 	//terminal_read_test();
 	//get_args_test();
+	TEST_OUTPUT("run_queue_test", run_queue_test());
+	TEST_OUTPUT("wait_queue_test", wait_queue_test());
+	TEST_OUTPUT("tick_stop_test", tick_stop_test());
+	TEST_OUTPUT("mlfq_pick_test", mlfq_pick_test());
+	TEST_OUTPUT("set_quantum_test", set_quantum_test());
+	TEST_OUTPUT("switch_bench_test", switch_bench_test());
+	TEST_OUTPUT("tlb_flush_test", tlb_flush_test());
+	TEST_OUTPUT("global_page_test", global_page_test());
+	TEST_OUTPUT("syscall_fault_test", syscall_fault_test());
+	TEST_OUTPUT("apic_calibrate_test", apic_calibrate_test());
+	TEST_OUTPUT("clock_test", clock_test());
+	TEST_OUTPUT("timer_wheel_test", timer_wheel_test());
+	TEST_OUTPUT("rtc_virtual_test", rtc_virtual_test());
+	TEST_OUTPUT("rtc_adaptive_test", rtc_adaptive_test());
+	TEST_OUTPUT("frame_alloc_test", frame_alloc_test());
+	TEST_OUTPUT("mem_report_test", mem_report_test());
+	TEST_OUTPUT("demand_page_test", demand_page_test());
+	TEST_OUTPUT("fs_page_test", fs_page_test());
+	TEST_OUTPUT("fork_cow_test", fork_cow_test());
+	TEST_OUTPUT("slab_test", slab_test());
+	TEST_OUTPUT("text_cache_test", text_cache_test());
+	TEST_OUTPUT("page_dir_test", page_dir_test());
+	TEST_OUTPUT("fork_tlb_test", fork_tlb_test());
+	TEST_OUTPUT("mmap_test", mmap_test());
+	TEST_OUTPUT("brk_test", brk_test());
+	TEST_OUTPUT("kstack_test", kstack_test());
+	TEST_OUTPUT("kstack_reap_test", kstack_reap_test());
+	TEST_OUTPUT("df_task_test", df_task_test());
 
 }
 
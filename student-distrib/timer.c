@@ -0,0 +1,235 @@
+#include "timer.h"
+#include "lib.h"
+#include "clock.h"
+
+// Reference: Varghese & Lauck, "Hashed and Hierarchical Timing Wheels"
+
+// Root level, one slot per millisecond of the next TVR_SIZE ms
+static timer_t tv_root[TVR_SIZE];
+
+// Outer levels, cascaded down one slot at a time as the root wraps
+static timer_t tv_levels[TVN_LEVELS][TVN_SIZE];
+
+// Next millisecond the wheel will process
+static uint32_t wheel_time = 0;
+
+// Timers linked into the wheel
+static uint32_t pending = 0;
+
+static void timer_insert(timer_t* timer);
+static void list_splice(timer_t* head, timer_t* list);
+static void list_unlink(timer_t* timer);
+static uint32_t cascade(int level);
+
+
+/* void init_timers(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Empties every slot and starts the wheel at the current time.
+ * Call after init_clock */
+void init_timers(void){
+    int i, level;
+    for(i=0; i < TVR_SIZE; i++){
+        tv_root[i].next = &tv_root[i];
+        tv_root[i].prev = &tv_root[i];
+    }
+    for(level=0; level < TVN_LEVELS; level++){
+        for(i=0; i < TVN_SIZE; i++){
+            tv_levels[level][i].next = &tv_levels[level][i];
+            tv_levels[level][i].prev = &tv_levels[level][i];
+        }
+    }
+    wheel_time = clock_ms();
+    pending = 0;
+}
+
+
+/* void timer_init(timer_t* timer, void (*fn)(int32_t data), int32_t data);
+ * Inputs: timer, fn - expiry callback, data - argument passed to fn
+ * Return Value: none
+ * Function: Prepares a timer that is not pending */
+void timer_init(timer_t* timer, void (*fn)(int32_t data), int32_t data){
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+
+/* void timer_add(timer_t* timer, uint32_t ms);
+ * Inputs: timer, ms - delay before it fires
+ * Return Value: none
+ * Function: Arms a timer in O(1), re-arming it if already pending. It fires
+ * on the first scheduling tick at least ms milliseconds from now */
+void timer_add(timer_t* timer, uint32_t ms){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    if(timer->next != NULL){
+        list_unlink(timer);
+        pending--;
+    }
+
+    // An empty wheel is not advanced, so catch it up before indexing by it
+    uint32_t now = clock_ms();
+    if(pending == 0) wheel_time = now;
+
+    timer->expires = now + ms;
+    timer_insert(timer);
+    pending++;
+
+    restore_flags(flags);
+}
+
+
+/* int32_t timer_cancel(timer_t* timer);
+ * Inputs: timer
+ * Return Value: 1 if the timer was pending, 0 otherwise
+ * Function: Disarms a timer in O(1) */
+int32_t timer_cancel(timer_t* timer){
+    uint32_t flags;
+    cli_and_save(flags);
+
+    int32_t was_pending = (timer->next != NULL);
+    if(was_pending){
+        list_unlink(timer);
+        pending--;
+    }
+
+    restore_flags(flags);
+    return was_pending;
+}
+
+
+/* int32_t timer_pending(timer_t* timer);
+ * Inputs: timer
+ * Return Value: 1 if the timer is armed, 0 otherwise
+ * Function: Checks whether a timer is linked into the wheel */
+int32_t timer_pending(timer_t* timer){
+    return timer->next != NULL;
+}
+
+
+/* uint32_t timers_pending(void);
+ * Inputs: void
+ * Return Value: number of armed timers
+ * Function: Lets the scheduler keep a tick running while timers are armed */
+uint32_t timers_pending(void){
+    return pending;
+}
+
+
+/* void timer_run(void);
+ * Inputs: void
+ * Return Value: none
+ * Function: Called from the scheduling tick with interrupts disabled.
+ * Advances the wheel to the current time, firing the timers of each
+ * millisecond passed. The cost depends on the time elapsed since the last
+ * tick, not on the number of armed timers */
+void timer_run(void){
+    uint32_t now = clock_ms();
+    timer_t list;
+
+    while(pending != 0 && (int32_t)(now - wheel_time) >= 0){
+        uint32_t index = wheel_time & TVR_MASK;
+
+        // Root level wrapped, pull the next span down from the levels above
+        if(index == 0){
+            int level;
+            for(level=0; level < TVN_LEVELS; level++){
+                if(cascade(level) != 0) break;
+            }
+        }
+
+        // Step first so timers added by the callbacks land in a later slot
+        wheel_time++;
+
+        list_splice(&tv_root[index], &list);
+        while(list.next != &list){
+            timer_t* timer = list.next;
+            list_unlink(timer);
+            pending--;
+            timer->fn(timer->data);
+        }
+    }
+}
+
+
+/* void timer_insert(timer_t* timer);
+ * Inputs: timer - with expires set
+ * Return Value: none
+ * Function: Links a timer into the slot of the level that covers its
+ * distance from the wheel time */
+static void timer_insert(timer_t* timer){
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel_time;
+    timer_t* head;
+
+    if((int32_t)delta < 0){
+        // Already due, fire on the next step
+        head = &tv_root[wheel_time & TVR_MASK];
+    } else if(delta < TVR_SIZE){
+        head = &tv_root[expires & TVR_MASK];
+    } else {
+        int level = 0;
+        while(level < TVN_LEVELS - 1 && delta >= (1U << (TVR_BITS + (level + 1) * TVN_BITS))){
+            level++;
+        }
+        head = &tv_levels[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+/* uint32_t cascade(int level);
+ * Inputs: level - outer level to cascade from
+ * Return Value: slot index that was cascaded
+ * Function: Re-inserts the timers of the level's current slot, which now
+ * fall within the span of the levels below */
+static uint32_t cascade(int level){
+    uint32_t index = (wheel_time >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+    timer_t list;
+
+    list_splice(&tv_levels[level][index], &list);
+    while(list.next != &list){
+        timer_t* timer = list.next;
+        list_unlink(timer);
+        timer_insert(timer);
+    }
+    return index;
+}
+
+
+/* void list_splice(timer_t* head, timer_t* list);
+ * Inputs: head - slot to empty, list - uninitialized list head
+ * Return Value: none
+ * Function: Moves every timer of a slot onto a local list in O(1) */
+static void list_splice(timer_t* head, timer_t* list){
+    if(head->next == head){
+        list->next = list;
+        list->prev = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head;
+    head->prev = head;
+}
+
+
+/* void list_unlink(timer_t* timer);
+ * Inputs: timer - linked timer
+ * Return Value: none
+ * Function: Unlinks a timer from its list and marks it not pending */
+static void list_unlink(timer_t* timer){
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "types.h"
+
+// Wheel geometry: a 256 slot root level of 1 ms slots, then four 64 slot
+// levels each covering 64 times the span of the one below (all 32 bits)
+#define TVR_BITS    8
+#define TVN_BITS    6
+#define TVR_SIZE    (1 << TVR_BITS)
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVR_MASK    (TVR_SIZE - 1)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TVN_LEVELS  4
+
+// Kernel timer, linked into a wheel slot while pending
+typedef struct timer {
+    struct timer* next;         // NULL while not pending
+    struct timer* prev;
+    uint32_t expires;           // clock_ms() value it fires at
+    void (*fn)(int32_t data);   // called from the tick with the kernel lock held
+    int32_t data;
+} timer_t;
+
+void init_timers(void);
+void timer_init(timer_t* timer, void (*fn)(int32_t data), int32_t data);
+void timer_add(timer_t* timer, uint32_t ms);
+int32_t timer_cancel(timer_t* timer);
+int32_t timer_pending(timer_t* timer);
+uint32_t timers_pending(void);
+void timer_run(void);
+
+#endif /* _TIMER_H */
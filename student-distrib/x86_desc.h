@@ -15,6 +15,12 @@
 #define USER_DS     0x002B
 #define KERNEL_TSS  0x0030
 #define KERNEL_LDT  0x0038
+#define AP_TSS      0x0040      /* TSS of CPU 1, each further CPU adds 8 */
+#define DF_TSS      (AP_TSS + (MAX_CPUS - 1) * 8)   /* double fault task of CPU 0, each further CPU adds 8 */
+
+/* Most CPUs brought up, and the size of each one's idle (boot) stack */
+#define MAX_CPUS        4
+#define IDLE_STACK_SIZE 0x2000
 
 /* Size of the task state segment (TSS) */
 #define TSS_SIZE    104
@@ -123,6 +129,8 @@ extern uint32_t ldt;
 extern uint32_t tss_size;
 extern seg_desc_t tss_desc_ptr;
 extern tss_t tss;
+extern seg_desc_t ap_tss_desc_ptr[MAX_CPUS - 1];
+extern seg_desc_t df_tss_desc_ptr[MAX_CPUS];
 
 /* Sets runtime-settable parameters in the GDT entry for the LDT */
 #define SET_LDT_PARAMS(str, addr, lim)                          \
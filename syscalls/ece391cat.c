@@ -7,6 +7,8 @@ int main ()
 {
     int32_t fd, cnt;
     uint8_t buf[1024];
+    uint8_t* data;
+    uint32_t len;
 
     if (0 != ece391_getargs (buf, 1024)) {
         ece391_fdputs (1, (uint8_t*)"could not read arguments\n");
@@ -18,6 +20,14 @@ int main ()
 	return 2;
     }
 
+    /* map the whole file, read it when it does not fit */
+    len = 0xFFFFFFFF;
+    if (0 != (data = ece391_mmap (fd, &len))) {
+	if (-1 == ece391_write (1, data, len))
+	    return 3;
+	return 0;
+    }
+
     while (0 != (cnt = ece391_read (fd, buf, 1024))) {
         if (-1 == cnt) {
 	    ece391_fdputs (1, (uint8_t*)"file read failed\n");
@@ -6,17 +6,38 @@
 #define BUFSIZE 1024
 #define SBUFSIZE 33
 
-int32_t
-do_one_file (const char* s, const char* fname) 
+/* search a mapped file, which is read-only so lines are not terminated */
+static void
+search_map (const char* s, const char* fname, const uint8_t* data, uint32_t len)
 {
-    int32_t fd, cnt, last, line_start, line_end, check, s_len;
-    uint8_t data[BUFSIZE+1];
+    uint32_t line_start, line_end, check, s_len;
 
     s_len = ece391_strlen ((uint8_t*)s);
-    if (-1 == (fd = ece391_open ((uint8_t*)fname))) {
-        ece391_fdputs (1, (uint8_t*)"file open failed\n");
-        return -1;
+    for (line_start = 0; line_start < len; line_start = line_end + 1) {
+	line_end = line_start;
+	while (line_end < len && '\n' != data[line_end])
+	    line_end++;
+	for (check = line_start; check + s_len <= line_end; check++) {
+	    if (s[0] == data[check] && 
+		0 == ece391_strncmp (data + check, (uint8_t*)s, s_len)) {
+		ece391_fdputs (1, (uint8_t*)fname);
+		ece391_fdputs (1, (uint8_t*)":");
+		ece391_write (1, data + line_start, line_end - line_start);
+		ece391_fdputs (1, (uint8_t*)"\n");
+		break;
+	    }
+	}
     }
+}
+
+/* search a file through read, a buffer at a time */
+static int32_t
+search_read (const char* s, const char* fname, int32_t fd)
+{
+    int32_t cnt, last, line_start, line_end, check, s_len;
+    uint8_t data[BUFSIZE+1];
+
+    s_len = ece391_strlen ((uint8_t*)s);
     last = 0;
     while (1) {
         cnt = ece391_read (fd, data + last, BUFSIZE - last);
@@ -58,6 +79,28 @@ do_one_file (const char* s, const char* fname)
 	if (0 == cnt)
 	    break;
     }
+    return 0;
+}
+
+int32_t
+do_one_file (const char* s, const char* fname) 
+{
+    int32_t fd;
+    uint8_t* map;
+    uint32_t len;
+
+    if (-1 == (fd = ece391_open ((uint8_t*)fname))) {
+        ece391_fdputs (1, (uint8_t*)"file open failed\n");
+        return -1;
+    }
+
+    /* map the whole file, read it when it does not fit */
+    len = 0xFFFFFFFF;
+    if (0 != (map = ece391_mmap (fd, &len)))
+	search_map (s, fname, map, len);
+    else if (-1 == search_read (s, fname, fd))
+	return -1;
+
     if (-1 == ece391_close (fd)) {
         ece391_fdputs (1, (uint8_t*)"file close failed\n");
         return -1;